@@ -0,0 +1,465 @@
+/*
+ * File:   bench.cc
+ *
+ * Microbenchmarks for FileCacheImpl. Every result is printed as one CSV
+ * line on stdout (header first) so runs can be diffed and plotted:
+ *
+ *   file_cache_bench [-t max_threads] [-n ops] [-s size,size,...] [-d dir]
+ *
+ * Working files are created in a fresh directory under 'dir' (default
+ * $TMPDIR or /tmp) and removed afterwards.
+ */
+
+#include <cstdlib>
+#include "file_cache_blocks.h"
+#include "file_cache_impl.h"
+#include "file_cache_simd.h"
+#include "tool_util.h"
+#include <thread>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+struct BenchConfig {
+    BenchConfig() : max_threads(thread::hardware_concurrency()),
+                    ops(20000)
+    {
+        if (max_threads < 1) {
+            max_threads = 1;
+        }
+        cache_sizes.push_back(16);
+        cache_sizes.push_back(128);
+        cache_sizes.push_back(1024);
+    }
+    int max_threads;
+    int ops;
+    vector<int> cache_sizes;
+    string dir;
+};
+
+static double
+seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static vector<string>
+file_names(const string& dir, int count)
+{
+    vector<string> names;
+    for (int i = 0; i < count; i++) {
+        ostringstream name;
+        name << dir << "/f" << i;
+        names.push_back(name.str());
+    }
+    return names;
+}
+
+static void
+print_header()
+{
+    cout << "benchmark,cache_entries,threads,ops,seconds,ns_per_op,ops_per_sec,"
+         << "hit_ratio,pin_p50_ns,pin_p99_ns,pin_p999_ns,write_back_bytes,"
+         << "remote_ratio" << endl;
+}
+
+//'remote_ratio' is only measured by the NUMA benchmarks, negative for none
+static void
+print_result(const char *benchmark, int cache_entries, int threads,
+             uint64_t ops, double seconds, const FileCacheStats& stats,
+             const FileCacheLatency& latency, double remote_ratio = -1)
+{
+    uint64_t lookups = stats.hits + stats.misses;
+    cout << benchmark << "," << cache_entries << "," << threads << ","
+         << ops << "," << seconds << ","
+         << (ops ? seconds * 1e9 / ops : 0) << ","
+         << (seconds > 0 ? ops / seconds : 0) << ","
+         << (lookups ? (double)stats.hits / lookups : 0) << ","
+         << latency.pin.Percentile(0.50) << ","
+         << latency.pin.Percentile(0.99) << ","
+         << latency.pin.Percentile(0.999) << ","
+         << stats.write_back_bytes << ",";
+    if (remote_ratio >= 0) {
+        cout << remote_ratio;
+    }
+    cout << endl;
+}
+
+static void
+print_result(const char *benchmark, int cache_entries, int threads,
+             uint64_t ops, double seconds, FileCacheImpl& fc,
+             double remote_ratio = -1)
+{
+    print_result(benchmark, cache_entries, threads, ops, seconds,
+                 fc.GetStats(), fc.GetLatency(), remote_ratio);
+}
+
+/*bench_hit_file_data
+ * FileData() on files that are already pinned: the lock + map lookup path,
+ * or with 'front' mostly the per-thread front cache.
+ */
+static void
+bench_hit_file_data(const BenchConfig& cfg, int cache_entries, bool front)
+{
+    FileCacheOptions options;
+    options.front_cache = front;
+    FileCacheImpl fc(cache_entries, options);
+    vector<string> names = file_names(cfg.dir, cache_entries);
+    fc.PinFiles(names);
+    fc.GetLatency(true);
+    uint64_t ops = (uint64_t)cfg.ops * 50;
+    uintptr_t sink = 0;
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < ops; i++) {
+        sink += (uintptr_t)fc.FileData(names[i % names.size()]);
+    }
+    double seconds = seconds_since(start);
+    print_result(front ? "hit_file_data_front" : "hit_file_data",
+                 cache_entries, 1, ops, seconds, fc);
+    fc.UnpinFiles(names);
+    if (sink == 1) {
+        cerr << sink << endl;
+    }
+}
+
+/*bench_pin_cycle
+ * Pins and unpins single files cycling over twice the cache size, so most
+ * PinFiles() calls miss and have to evict. With 'dirty' each file is
+ * written before it is unpinned and every eviction is a write-back.
+ */
+static void
+bench_pin_cycle(const BenchConfig& cfg, int cache_entries, bool dirty)
+{
+    vector<string> names = file_names(cfg.dir, cache_entries * 2);
+    {
+        //Make sure the files exist before timing
+        FileCacheImpl fc(cache_entries);
+        for (const auto& name : names) {
+            vector<string> file_vec(1, name);
+            fc.PinFiles(file_vec);
+            fc.UnpinFiles(file_vec);
+        }
+    }
+    FileCacheImpl timed_fc(cache_entries);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < cfg.ops; i++) {
+        vector<string> file_vec(1, names[i % names.size()]);
+        timed_fc.PinFiles(file_vec);
+        if (dirty) {
+            timed_fc.MutableFileData(file_vec[0])[0] = (char)i;
+        }
+        timed_fc.UnpinFiles(file_vec);
+    }
+    double seconds = seconds_since(start);
+    print_result(dirty ? "dirty_evict" : "miss_pin", cache_entries, 1,
+                 cfg.ops, seconds, timed_fc);
+}
+
+/*bench_durability
+ * dirty_evict under each FileCacheOptions::durability mode. Uses a tenth
+ * of the ops since the synchronous mode waits for storage on every
+ * eviction; the time includes the destructor so deferred syncs count.
+ */
+static void
+bench_durability(const BenchConfig& cfg, int cache_entries,
+                 FileCacheDurability durability, const char *benchmark)
+{
+    vector<string> names = file_names(cfg.dir, cache_entries * 2);
+    int ops = cfg.ops / 10 > 0 ? cfg.ops / 10 : 1;
+    FileCacheOptions options;
+    options.durability = durability;
+    FileCacheStats stats;
+    FileCacheLatency latency;
+    auto start = chrono::steady_clock::now();
+    {
+        FileCacheImpl fc(cache_entries, options);
+        for (int i = 0; i < ops; i++) {
+            vector<string> file_vec(1, names[i % names.size()]);
+            fc.PinFiles(file_vec);
+            fc.MutableFileData(file_vec[0])[0] = (char)i;
+            fc.UnpinFiles(file_vec);
+        }
+        stats = fc.GetStats();
+        latency = fc.GetLatency();
+    }
+    double seconds = seconds_since(start);
+    print_result(benchmark, cache_entries, 1, ops, seconds, stats, latency);
+}
+
+/*bench_flush
+ * Updates a set of up to 8 files together and makes it durable with
+ * Flush(), either by writing the files in place or, with 'wal', by
+ * syncing the write-ahead log. A tenth of the ops, as above.
+ */
+static void
+bench_flush(const BenchConfig& cfg, int cache_entries, bool wal)
+{
+    vector<string> names = file_names(cfg.dir, cache_entries * 2);
+    int set_size = cache_entries < 8 ? cache_entries : 8;
+    int ops = cfg.ops / 10 > 0 ? cfg.ops / 10 : 1;
+    FileCacheOptions options;
+    if (wal) {
+        options.wal_path = cfg.dir + "/wal";
+    }
+    FileCacheImpl fc(cache_entries, options);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < ops; i++) {
+        vector<string> file_vec;
+        for (int j = 0; j < set_size; j++) {
+            file_vec.push_back(names[(i * set_size + j) % names.size()]);
+        }
+        fc.PinFiles(file_vec);
+        for (const auto& name : file_vec) {
+            fc.MutableFileRange(name, (i * 512) % FILE_SIZE, 512)[0] = (char)i;
+        }
+        fc.UnpinFiles(file_vec);
+        fc.Flush(file_vec);
+    }
+    double seconds = seconds_since(start);
+    print_result(wal ? "flush_wal" : "flush_in_place", cache_entries, 1,
+                 ops, seconds, fc);
+}
+
+/*bench_txn
+ * The flush_wal loop as transactions: each round's files change together
+ * and reach the log as one batch with one sync.
+ */
+static void
+bench_txn(const BenchConfig& cfg, int cache_entries)
+{
+    vector<string> names = file_names(cfg.dir, cache_entries * 2);
+    int set_size = cache_entries < 8 ? cache_entries : 8;
+    int ops = cfg.ops / 10 > 0 ? cfg.ops / 10 : 1;
+    FileCacheOptions options;
+    options.wal_path = cfg.dir + "/wal";
+    FileCacheImpl fc(cache_entries, options);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < ops; i++) {
+        vector<string> file_vec;
+        for (int j = 0; j < set_size; j++) {
+            file_vec.push_back(names[(i * set_size + j) % names.size()]);
+        }
+        uint64_t txn = fc.BeginTxn(file_vec);
+        for (const auto& name : file_vec) {
+            fc.MutableFileRange(name, (i * 512) % FILE_SIZE, 512)[0] = (char)i;
+        }
+        fc.Commit(txn);
+    }
+    double seconds = seconds_since(start);
+    print_result("txn_commit", cache_entries, 1, ops, seconds, fc);
+}
+
+/*bench_block_sparse
+ * The block engine with one block per cache entry: 512 byte updates at
+ * random offsets of a 256MB file, so only the blocks touched are read and
+ * evictions write back single blocks.
+ */
+static void
+bench_block_sparse(const BenchConfig& cfg, int cache_entries)
+{
+    const uint64_t file_bytes = (uint64_t)256 << 20;
+    string name = cfg.dir + "/sparse";
+    FileCacheBlocks blocks(cache_entries);
+    mt19937_64 rng(1);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < cfg.ops; i++) {
+        uint64_t offset = rng() % (file_bytes / 512) * 512;
+        blocks.PinRange(name, offset, 512);
+        size_t len = 512;
+        blocks.MutableData(name, offset, len)[0] = (char)i;
+        blocks.UnpinRange(name, offset, 512);
+    }
+    double seconds = seconds_since(start);
+    print_result("block_sparse", cache_entries, 1, cfg.ops, seconds,
+                 blocks.GetStats(), FileCacheLatency());
+}
+
+/*bench_numa
+ * One thread per NUMA node, bound to it, reading whole files from its own
+ * share of the working set (files split across nodes the way kNumaShard
+ * places them). With kNumaNone and kNumaShard the main thread loads
+ * everything first, as a single loader would; with kNumaLocal each
+ * thread loads its own share. remote_ratio is the fraction of the files
+ * whose buffer ended up on another node than the thread reading it.
+ */
+static void
+bench_numa(const BenchConfig& cfg, int cache_entries,
+           FileCacheNumaPlacement placement, const char *benchmark)
+{
+    int nodes = FileCacheNumaPool::Nodes();
+    vector<string> names = file_names(cfg.dir, cache_entries);
+    vector<vector<string> > shares(nodes);
+    for (const auto& name : names) {
+        shares[FileCacheHash64(name.data(), name.size()) % nodes].push_back(
+                name);
+    }
+    FileCacheOptions options;
+    options.numa_placement = placement;
+    FileCacheImpl fc(cache_entries, options);
+    if (placement != kNumaLocal) {
+        fc.PinFiles(names);
+        fc.UnpinFiles(names);
+    }
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int node = 0; node < nodes; node++) {
+        workers.push_back(thread([&, node]() {
+            const vector<string>& share = shares[node];
+            if (share.empty()) {
+                return;
+            }
+            FileCacheNumaPool::RunOnNode(node);
+            uint64_t sum = 0;
+            for (int i = 0; i < cfg.ops; i++) {
+                vector<string> file_vec(1, share[i % share.size()]);
+                fc.PinFiles(file_vec);
+                const char *data = fc.FileData(file_vec[0]);
+                for (size_t j = 0; j < FILE_SIZE; j += 64) {
+                    sum += data[j];
+                }
+                fc.UnpinFiles(file_vec);
+            }
+            if (sum == 1) {
+                cerr << sum << endl;
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double seconds = seconds_since(start);
+    uint64_t remote = 0;
+    for (int node = 0; node < nodes; node++) {
+        for (const auto& name : shares[node]) {
+            vector<string> file_vec(1, name);
+            fc.PinFiles(file_vec);
+            if (FileCacheNumaPool::NodeOf(fc.FileData(name)) != node) {
+                remote++;
+            }
+            fc.UnpinFiles(file_vec);
+        }
+    }
+    print_result(benchmark, cache_entries, nodes, (uint64_t)cfg.ops * nodes,
+                 seconds, fc, names.empty() ? 0 : (double)remote / names.size());
+}
+
+/*bench_scaling
+ * 'threads' threads each pin one file at a time, 80% of the time from a
+ * hot set shared by all threads that fits in half the cache, otherwise
+ * from a cold set four times the cache size.
+ */
+static void
+bench_scaling(const BenchConfig& cfg, int cache_entries, int threads)
+{
+    int hot_count = cache_entries / 2 > 0 ? cache_entries / 2 : 1;
+    vector<string> hot = file_names(cfg.dir, hot_count);
+    vector<string> cold = file_names(cfg.dir + "/cold", cache_entries * 4);
+    FileCacheImpl fc(cache_entries);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t]() {
+            mt19937 rng(t + 1);
+            for (int i = 0; i < cfg.ops; i++) {
+                const vector<string>& set = (rng() % 10 < 8) ? hot : cold;
+                vector<string> file_vec(1, set[rng() % set.size()]);
+                fc.PinFiles(file_vec);
+                volatile char c = fc.FileData(file_vec[0])[0];
+                (void)c;
+                fc.UnpinFiles(file_vec);
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double seconds = seconds_since(start);
+    print_result("scaling", cache_entries, threads,
+                 (uint64_t)cfg.ops * threads, seconds, fc);
+}
+
+static void
+usage(const char *prog)
+{
+    cerr << "usage: " << prog
+         << " [-t max_threads] [-n ops] [-s size,size,...] [-d dir]" << endl;
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    BenchConfig cfg;
+    string parent;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:s:d:")) != -1) {
+        switch (opt) {
+        case 't':
+            cfg.max_threads = atoi(optarg);
+            break;
+        case 'n':
+            cfg.ops = atoi(optarg);
+            break;
+        case 's': {
+            cfg.cache_sizes.clear();
+            istringstream sizes(optarg);
+            string size;
+            while (getline(sizes, size, ',')) {
+                cfg.cache_sizes.push_back(atoi(size.c_str()));
+            }
+            break;
+        }
+        case 'd':
+            parent = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (cfg.max_threads < 1 || cfg.ops < 1 || cfg.cache_sizes.empty()) {
+        usage(argv[0]);
+    }
+
+    cfg.dir = MakeTempDir(parent, "file_cache_bench");
+    if (cfg.dir.empty()) {
+        return 1;
+    }
+    mkdir((cfg.dir + "/cold").c_str(), 0777);
+
+    print_header();
+    for (int cache_entries : cfg.cache_sizes) {
+        bench_hit_file_data(cfg, cache_entries, false);
+        bench_hit_file_data(cfg, cache_entries, true);
+        bench_pin_cycle(cfg, cache_entries, false);
+        bench_pin_cycle(cfg, cache_entries, true);
+        bench_durability(cfg, cache_entries, kDurabilityNone,
+                         "durability_none");
+        bench_durability(cfg, cache_entries, kDurabilitySync,
+                         "durability_sync");
+        bench_durability(cfg, cache_entries, kDurabilityGroupCommit,
+                         "durability_group_commit");
+        bench_durability(cfg, cache_entries, kDurabilityAsync,
+                         "durability_async");
+        bench_flush(cfg, cache_entries, false);
+        bench_flush(cfg, cache_entries, true);
+        bench_txn(cfg, cache_entries);
+        bench_block_sparse(cfg, cache_entries);
+        bench_numa(cfg, cache_entries, kNumaNone, "numa_none");
+        bench_numa(cfg, cache_entries, kNumaLocal, "numa_local");
+        bench_numa(cfg, cache_entries, kNumaShard, "numa_shard");
+        for (int threads = 1; ; threads *= 2) {
+            if (threads > cfg.max_threads) {
+                threads = cfg.max_threads;
+            }
+            bench_scaling(cfg, cache_entries, threads);
+            if (threads == cfg.max_threads) {
+                break;
+            }
+        }
+    }
+    RemoveTree(cfg.dir);
+    return 0;
+}
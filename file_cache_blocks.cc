@@ -0,0 +1,472 @@
+#include "file_cache_blocks.h"
+#include "file_cache_impl.h"
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const size_t kBlockAlign = 4096;
+
+FileCacheBlocks::FileCacheBlocks(size_t max_blocks, size_t block_size) :
+    max_blocks_(std::max<size_t>(1, max_blocks)),
+    block_size_((block_size + kBlockAlign - 1) / kBlockAlign * kBlockAlign),
+    resident_blocks_(0),
+    pinned_blocks_(0),
+    dirty_blocks_(0),
+    resident_gauge_(0)
+{
+    if (block_size_ == 0) {
+        block_size_ = kBlockAlign;
+    }
+}
+
+FileCacheBlocks::~FileCacheBlocks()
+{
+    std::lock_guard<std::mutex> lock(m_);
+    for (auto& file : files_) {
+        BlockFile& bf = file.second;
+        for (auto& block : bf.blocks) {
+            if (block.second.dirty) {
+                write_back_block(bf, block.first, block.second);
+            }
+        }
+        ::close(bf.fd);
+    }
+}
+
+/*open_file
+ * Input: filename, m_ held
+ * Output: its block table, opening or creating the file if it has none,
+ *         or nullptr. The caller is a user of it until release_file().
+ */
+FileCacheBlocks::BlockFile *
+FileCacheBlocks::open_file(const std::string& file_name)
+{
+    auto fitr = files_.find(file_name);
+    if (fitr == files_.end()) {
+        int fd = ::open(file_name.c_str(), O_RDWR | O_CREAT, 0777);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) < 0) {
+            std::ostringstream err_str;
+            err_str << "Error opening file " << file_name
+                    << " : " << strerror(errno);
+            fprintf(stderr, "%s\n", err_str.str().c_str());
+            counters_.Add(FileCacheCounters::kIoErrors);
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return nullptr;
+        }
+        fitr = files_.emplace(file_name, BlockFile()).first;
+        fitr->second.fd = fd;
+        fitr->second.name = file_name;
+        fitr->second.size = st.st_size;
+    }
+    fitr->second.users++;
+    return &fitr->second;
+}
+
+void
+FileCacheBlocks::release_file(BlockFile& bf)
+{
+    bf.users--;
+    forget_file_if_unused(bf);
+}
+
+/*forget_file_if_unused
+ * Closes and forgets a file that has no blocks left and that no call is
+ * using. m_ held.
+ */
+void
+FileCacheBlocks::forget_file_if_unused(BlockFile& bf)
+{
+    if (bf.users == 0 && bf.blocks.empty()) {
+        //Erasing by iterator, the key is bf.name itself
+        ::close(bf.fd);
+        files_.erase(files_.find(bf.name));
+    }
+}
+
+/*load_block
+ * Input: file, block index and the new, empty block for it, m_ held
+ * Output: false if the read failed
+ */
+bool
+FileCacheBlocks::load_block(BlockFile& bf, uint64_t index, Block& block)
+{
+    block.buf.reset(new char[block_size_]);
+    size_t done = 0;
+    while (done < block_size_) {
+        ssize_t nbytes = ::pread(bf.fd, block.buf.get() + done,
+                                 block_size_ - done,
+                                 (off_t)(index * block_size_ + done));
+        if (nbytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes < 0) {
+            std::ostringstream err_str;
+            err_str << "Error reading file " << bf.name
+                    << " : " << strerror(errno);
+            fprintf(stderr, "%s\n", err_str.str().c_str());
+            counters_.Add(FileCacheCounters::kIoErrors);
+            block.buf.reset();
+            return false;
+        }
+        if (nbytes == 0) {
+            //Past the end of the file
+            memset(block.buf.get() + done, 0, block_size_ - done);
+            break;
+        }
+        done += nbytes;
+    }
+    return true;
+}
+
+/*write_back_block
+ * Input: dirty block, m_ held
+ * Output: false if the write failed. Only the part of the block below
+ *         the file's size is written, so the last block doesn't pad the
+ *         file to a block boundary. The block is clean afterwards either
+ *         way, as with FileCacheImpl's evictions.
+ */
+bool
+FileCacheBlocks::write_back_block(BlockFile& bf, uint64_t index, Block& block)
+{
+    uint64_t start = index * block_size_;
+    size_t len = 0;
+    if (bf.size > start) {
+        len = std::min<uint64_t>(block_size_, bf.size - start);
+    }
+    bool ok = true;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t nbytes = ::pwrite(bf.fd, block.buf.get() + done, len - done,
+                                  (off_t)(start + done));
+        if (nbytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes < 0) {
+            std::ostringstream err_str;
+            err_str << "Error writing file " << bf.name
+                    << " : " << strerror(errno);
+            fprintf(stderr, "%s\n", err_str.str().c_str());
+            counters_.Add(FileCacheCounters::kIoErrors);
+            ok = false;
+            break;
+        }
+        done += nbytes;
+    }
+    if (ok) {
+        counters_.Add(FileCacheCounters::kWriteBacks);
+        counters_.Add(FileCacheCounters::kWriteBackBytes, len);
+    }
+    block.dirty = false;
+    dirty_blocks_.fetch_sub(1, std::memory_order_relaxed);
+    return ok;
+}
+
+/*evict_block
+ * Frees the least recently used unpinned block, writing it back first if
+ * it is dirty. m_ held. Returns false if every block is pinned.
+ */
+bool
+FileCacheBlocks::evict_block()
+{
+    if (lru_.empty()) {
+        return false;
+    }
+    BlockFile *bf = lru_.front().first;
+    uint64_t index = lru_.front().second;
+    lru_.pop_front();
+    auto bitr = bf->blocks.find(index);
+    if (bitr->second.dirty) {
+        write_back_block(*bf, index, bitr->second);
+        counters_.Add(FileCacheCounters::kDirtyEvictions);
+    } else {
+        counters_.Add(FileCacheCounters::kCleanEvictions);
+    }
+    bf->blocks.erase(bitr);
+    resident_blocks_--;
+    resident_gauge_.fetch_sub(1, std::memory_order_relaxed);
+    forget_file_if_unused(*bf);
+    return true;
+}
+
+/*pin_blocks
+ * Input: blocks [first, last] of a file the caller is using, no more
+ *        than max_blocks_ of them, m_ held
+ * Output: false, with none of them pinned, if a block could not be read.
+ *         Waits for an unpinned block to evict when the cache is full.
+ */
+bool
+FileCacheBlocks::pin_blocks(std::unique_lock<std::mutex>& lock, BlockFile& bf,
+                            uint64_t first, uint64_t last)
+{
+    uint64_t index = first;
+    while (index <= last) {
+        auto bitr = bf.blocks.find(index);
+        if (bitr != bf.blocks.end()) {
+            if (bitr->second.pins++ == 0) {
+                lru_.erase(bitr->second.lru_pos);
+                pinned_blocks_.fetch_add(1, std::memory_order_relaxed);
+            }
+            counters_.Add(FileCacheCounters::kHits);
+            index++;
+            continue;
+        }
+        if (resident_blocks_ >= max_blocks_ && !evict_block()) {
+            //All pinned, wait and look again, the block may have been
+            //loaded in the meantime
+            auto wait_start = std::chrono::steady_clock::now();
+            cv_.wait(lock, [this]() {
+                return resident_blocks_ < max_blocks_ || !lru_.empty();
+            });
+            counters_.Add(FileCacheCounters::kWaitNs,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() -
+                            wait_start).count());
+            continue;
+        }
+        Block block;
+        if (!load_block(bf, index, block)) {
+            if (index > first) {
+                unpin_blocks(bf, first, index - 1);
+            }
+            return false;
+        }
+        block.pins = 1;
+        bf.blocks.emplace(index, std::move(block));
+        resident_blocks_++;
+        resident_gauge_.fetch_add(1, std::memory_order_relaxed);
+        pinned_blocks_.fetch_add(1, std::memory_order_relaxed);
+        counters_.Add(FileCacheCounters::kMisses);
+        index++;
+    }
+    return true;
+}
+
+void
+FileCacheBlocks::unpin_blocks(BlockFile& bf, uint64_t first, uint64_t last)
+{
+    bool freed = false;
+    for (uint64_t index = first; index <= last; index++) {
+        auto bitr = bf.blocks.find(index);
+        if (bitr == bf.blocks.end() || bitr->second.pins == 0) {
+            continue;
+        }
+        if (--bitr->second.pins == 0) {
+            bitr->second.lru_pos = lru_.insert(lru_.end(),
+                                               std::make_pair(&bf, index));
+            pinned_blocks_.fetch_sub(1, std::memory_order_relaxed);
+            freed = true;
+        }
+    }
+    if (freed) {
+        cv_.notify_all();
+    }
+}
+
+bool
+FileCacheBlocks::PinFiles(const std::vector<std::string>& file_vec)
+{
+    std::unique_lock<std::mutex> lock(m_);
+    //Open and size every file first, so that a call that can't succeed is
+    //refused before it pins anything
+    std::vector<std::pair<BlockFile *, uint64_t> > pins;
+    uint64_t total_blocks = 0;
+    bool ok = true;
+    for (const auto& file_name : file_vec) {
+        BlockFile *bf = open_file(file_name);
+        if (bf == nullptr) {
+            ok = false;
+            break;
+        }
+        //The FileCache contract has every file FILE_SIZE bytes long
+        uint64_t size = std::max<uint64_t>(bf->size, FILE_SIZE);
+        uint64_t blocks = (size + block_size_ - 1) / block_size_;
+        pins.push_back(std::make_pair(bf, blocks));
+        total_blocks += blocks;
+    }
+    if (ok && total_blocks > max_blocks_) {
+        for (auto& pin : pins) {
+            release_file(*pin.first);
+        }
+        throw std::runtime_error("Number of blocks being pinned exceed cache size");
+    }
+    size_t pinned = 0;
+    while (ok && pinned < pins.size()) {
+        ok = pin_blocks(lock, *pins[pinned].first, 0, pins[pinned].second - 1);
+        if (ok) {
+            pinned++;
+        }
+    }
+    for (size_t i = 0; i < pins.size(); i++) {
+        BlockFile& bf = *pins[i].first;
+        if (ok) {
+            bf.size = std::max<uint64_t>(bf.size, FILE_SIZE);
+            bf.whole_pins.insert(pins[i].second);
+        } else if (i < pinned) {
+            unpin_blocks(bf, 0, pins[i].second - 1);
+        }
+        release_file(bf);
+    }
+    return ok;
+}
+
+void
+FileCacheBlocks::UnpinFiles(const std::vector<std::string>& file_vec)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    for (const auto& file_name : file_vec) {
+        auto fitr = files_.find(file_name);
+        if (fitr == files_.end() || fitr->second.whole_pins.empty()) {
+            continue;
+        }
+        //Whole file pins cover prefixes of the file, which may have grown
+        //in between, so dropping any one of them leaves the rest intact
+        BlockFile& bf = fitr->second;
+        uint64_t blocks = *bf.whole_pins.begin();
+        bf.whole_pins.erase(bf.whole_pins.begin());
+        unpin_blocks(bf, 0, blocks - 1);
+    }
+}
+
+bool
+FileCacheBlocks::PinRange(const std::string& file_name, uint64_t offset,
+                          size_t len)
+{
+    if (len == 0) {
+        return true;
+    }
+    uint64_t first = offset / block_size_;
+    uint64_t last = (offset + len - 1) / block_size_;
+    if (last - first + 1 > max_blocks_) {
+        throw std::runtime_error("Number of blocks being pinned exceed cache size");
+    }
+    std::unique_lock<std::mutex> lock(m_);
+    BlockFile *bf = open_file(file_name);
+    if (bf == nullptr) {
+        return false;
+    }
+    bool ok = pin_blocks(lock, *bf, first, last);
+    release_file(*bf);
+    return ok;
+}
+
+void
+FileCacheBlocks::UnpinRange(const std::string& file_name, uint64_t offset,
+                            size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    auto fitr = files_.find(file_name);
+    if (fitr != files_.end()) {
+        unpin_blocks(fitr->second, offset / block_size_,
+                     (offset + len - 1) / block_size_);
+    }
+}
+
+/*pinned_block
+ * Input: filename and offset, m_ held
+ * Output: the pinned block holding that byte, or nullptr
+ */
+FileCacheBlocks::Block *
+FileCacheBlocks::pinned_block(const std::string& file_name, uint64_t offset)
+{
+    auto fitr = files_.find(file_name);
+    if (fitr == files_.end()) {
+        return nullptr;
+    }
+    auto bitr = fitr->second.blocks.find(offset / block_size_);
+    if (bitr == fitr->second.blocks.end() || bitr->second.pins == 0) {
+        return nullptr;
+    }
+    return &bitr->second;
+}
+
+const char *
+FileCacheBlocks::Data(const std::string& file_name, uint64_t offset,
+                      size_t& len)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    Block *block = pinned_block(file_name, offset);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    size_t in_block = offset % block_size_;
+    len = std::min(len, block_size_ - in_block);
+    return block->buf.get() + in_block;
+}
+
+char *
+FileCacheBlocks::MutableData(const std::string& file_name, uint64_t offset,
+                             size_t& len)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    Block *block = pinned_block(file_name, offset);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    size_t in_block = offset % block_size_;
+    len = std::min(len, block_size_ - in_block);
+    if (!block->dirty) {
+        block->dirty = true;
+        dirty_blocks_.fetch_add(1, std::memory_order_relaxed);
+    }
+    BlockFile& bf = files_.find(file_name)->second;
+    bf.size = std::max<uint64_t>(bf.size, offset + len);
+    return block->buf.get() + in_block;
+}
+
+bool
+FileCacheBlocks::Flush()
+{
+    std::lock_guard<std::mutex> lock(m_);
+    bool ok = true;
+    for (auto& file : files_) {
+        BlockFile& bf = file.second;
+        bool written = false;
+        for (auto& block : bf.blocks) {
+            //Pinned blocks may still be being written
+            if (block.second.dirty && block.second.pins == 0) {
+                ok = write_back_block(bf, block.first, block.second) && ok;
+                written = true;
+            }
+        }
+        if (written) {
+            counters_.Add(FileCacheCounters::kSyncs);
+            if (::fdatasync(bf.fd) < 0) {
+                counters_.Add(FileCacheCounters::kIoErrors);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+FileCacheStats
+FileCacheBlocks::GetStats() const
+{
+    FileCacheStats stats;
+    stats.hits = counters_.Sum(FileCacheCounters::kHits);
+    stats.misses = counters_.Sum(FileCacheCounters::kMisses);
+    stats.clean_evictions = counters_.Sum(FileCacheCounters::kCleanEvictions);
+    stats.dirty_evictions = counters_.Sum(FileCacheCounters::kDirtyEvictions);
+    stats.write_backs = counters_.Sum(FileCacheCounters::kWriteBacks);
+    stats.write_back_bytes = counters_.Sum(FileCacheCounters::kWriteBackBytes);
+    stats.syncs = counters_.Sum(FileCacheCounters::kSyncs);
+    stats.io_errors = counters_.Sum(FileCacheCounters::kIoErrors);
+    stats.wait_ns = counters_.Sum(FileCacheCounters::kWaitNs);
+    stats.pinned_entries = pinned_blocks_.load(std::memory_order_relaxed);
+    stats.dirty_entries = dirty_blocks_.load(std::memory_order_relaxed);
+    stats.resident_entries = resident_gauge_.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,128 @@
+
+#ifndef _FILE_CACHE_BLOCKS_H_
+#define _FILE_CACHE_BLOCKS_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "file_cache_stats.h"
+
+/* FileCacheBlocks
+ * Block-granular cache engine, an alternative to FileCacheImpl for
+ * sparse access to large files. The unit of caching is a block of a file,
+ * keyed by (file, block index), instead of a whole file: pins, eviction,
+ * dirty tracking and I/O all work one block at a time, so memory follows
+ * the blocks actually used rather than the files.
+ *
+ * Pins at file level map onto block pins. PinFiles() pins every block of
+ * each file, which is FILE_SIZE bytes long as far as the FileCache
+ * contract goes, or longer if the file already is; PinRange() pins just
+ * the blocks covering a byte range. Data() and MutableData() hand out one
+ * block at a time. Missing files are created, bytes past the end of a
+ * file read as zeros, and write-back extends files as far as they were
+ * pinned whole or written.
+ *
+ * At most max_blocks blocks are resident. Unpinned blocks are evicted
+ * least recently used first, dirty ones after writing them back; a pin
+ * that finds every block pinned waits, like FileCacheImpl::PinFiles(), and
+ * one that needs more than max_blocks blocks by itself throws
+ * std::runtime_error, as that wait would never end. All methods are
+ * thread safe, I/O happens under the cache lock.
+ */
+class FileCacheBlocks {
+public:
+    // 'block_size' is rounded up to a multiple of 4096.
+    FileCacheBlocks(size_t max_blocks, size_t block_size = 4096);
+    // Writes back the dirty blocks.
+    ~FileCacheBlocks();
+
+    // False, with nothing pinned, if a file can't be opened or a block
+    // can't be read. UnpinFiles() drops one pin of each file, only call it
+    // for files of a PinFiles() that succeeded.
+    bool PinFiles(const std::vector<std::string>& file_vec);
+    void UnpinFiles(const std::vector<std::string>& file_vec);
+
+    // Pins the blocks covering [offset, offset + len) of 'file_name'.
+    // False, with nothing pinned, if the file can't be opened or a block
+    // can't be read. UnpinRange() takes the same arguments.
+    bool PinRange(const std::string& file_name, uint64_t offset, size_t len);
+    void UnpinRange(const std::string& file_name, uint64_t offset,
+                    size_t len);
+
+    // Byte 'offset' of a pinned block, nullptr if its block isn't pinned.
+    // 'len' is trimmed to the bytes left in the block. MutableData() marks
+    // the block dirty and extends the file to offset + len.
+    const char *Data(const std::string& file_name, uint64_t offset,
+                     size_t& len);
+    char *MutableData(const std::string& file_name, uint64_t offset,
+                      size_t& len);
+
+    // Writes back every unpinned dirty block and fdatasync()s the files.
+    // Returns false if any write or sync failed.
+    bool Flush();
+
+    size_t BlockSize() const { return block_size_; }
+
+    // Counters as for FileCacheImpl, per block: hits and misses count
+    // block pins, the *_entries gauges count blocks.
+    FileCacheStats GetStats() const;
+
+private:
+    struct BlockFile;
+    typedef std::list<std::pair<BlockFile *, uint64_t> > BlockList;
+    struct Block {
+        Block() : pins(0), dirty(false) {}
+        std::unique_ptr<char[]> buf;
+        uint32_t pins;
+        bool dirty;
+        //Position on lru_ while unpinned
+        BlockList::iterator lru_pos;
+    };
+    struct BlockFile {
+        BlockFile() : fd(-1), size(0), users(0) {}
+        int fd;
+        std::string name;
+        //Bytes write-back keeps, at least the size on storage
+        uint64_t size;
+        //Calls between open_file() and their last use of the file
+        int users;
+        //Block counts of the PinFiles() pins held, see UnpinFiles()
+        std::multiset<uint64_t> whole_pins;
+        std::unordered_map<uint64_t, Block> blocks;
+    };
+
+    size_t max_blocks_;
+    size_t block_size_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::map<std::string, BlockFile> files_;
+    //Unpinned blocks, least recently used first
+    BlockList lru_;
+    size_t resident_blocks_;
+
+    FileCacheCounters counters_;
+    std::atomic<int64_t> pinned_blocks_;
+    std::atomic<int64_t> dirty_blocks_;
+    std::atomic<int64_t> resident_gauge_;
+
+    BlockFile *open_file(const std::string& file_name);
+    void release_file(BlockFile& bf);
+    void forget_file_if_unused(BlockFile& bf);
+    bool pin_blocks(std::unique_lock<std::mutex>& lock, BlockFile& bf,
+                    uint64_t first, uint64_t last);
+    void unpin_blocks(BlockFile& bf, uint64_t first, uint64_t last);
+    bool load_block(BlockFile& bf, uint64_t index, Block& block);
+    bool write_back_block(BlockFile& bf, uint64_t index, Block& block);
+    bool evict_block();
+    Block *pinned_block(const std::string& file_name, uint64_t offset);
+};
+
+#endif // _FILE_CACHE_BLOCKS_H_
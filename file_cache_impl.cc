@@ -1,4 +1,7 @@
 #include "file_cache_impl.h"
+#include "file_cache_lz.h"
+#include "file_cache_simd.h"
+#include "file_cache_write_protect.h"
 #include <stdexcept>
 #include <errno.h>
 #include <sstream>
@@ -6,8 +9,18 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <tuple>
 
 
 /* Notes:
@@ -35,37 +48,221 @@
  *    
  */
 
+/*zero_page
+ * Output: the FILE_SIZE buffer of zeros shared by every entry whose file
+ *         is new or all zero. Mapped read-only, so a store that bypasses
+ *         copy_on_write() faults instead of changing other entries.
+ */
+static const std::shared_ptr<char>&
+zero_page()
+{
+    static const std::shared_ptr<char> page([]() {
+        void *p = ::mmap(nullptr, FILE_SIZE, PROT_READ,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Error mapping the zero page");
+        }
+        return (char *)p;
+    }(), [](char *) {});
+    return page;
+}
+
+static bool
+is_zero_page(const std::shared_ptr<char>& buf)
+{
+    return buf.get() == zero_page().get();
+}
+
+/* Front cache slot, see FileCacheOptions::front_cache. Direct-mapped by
+ * the name's hash, the name itself resolves collisions.
+ */
+struct FrontCacheSlot {
+    FrontCacheSlot() : cache_id(0), generation(0), hash(0), data(nullptr) {}
+    uint64_t cache_id;
+    uint64_t generation;
+    uint64_t hash;
+    std::string name;
+    const char *data;
+};
+static const size_t kFrontCacheSlots = 64;
+static thread_local FrontCacheSlot front_cache[kFrontCacheSlots];
+//0 never names a cache, so empty slots never match
+static std::atomic<uint64_t> next_cache_id(1);
+
+FileCacheImpl::FileCacheImpl(int max_cache_entries,
+                             const FileCacheOptions& options) :
+    FileCache(max_cache_entries),
+    options_(options),
+    pinned_entries_(0),
+    dirty_entries_(0),
+    resident_entries_(0),
+    stopping_(false),
+    next_checkpoint_(0),
+    access_clock_(0),
+    write_back_seq_(0),
+    prefetch_next_(0),
+    prefetch_stop_(false),
+    compress_clock_(0),
+    compressed_seq_(0),
+    compressed_bytes_(0),
+    compressed_entries_(0),
+    compressed_bytes_gauge_(0),
+    dedup_saved_bytes_(0),
+    snapshot_epoch_(0),
+    snapshot_versions_(0),
+    next_txn_(0),
+    ranges_(new FileCacheRangeTable(options_.range_block_size,
+                                    options_.range_cache_bytes, counters_)),
+    cache_id_(next_cache_id.fetch_add(1)),
+    generation_(0)
+{
+    if (options_.lazy_load) {
+        if (options_.write_protect || options_.dedup) {
+            throw std::runtime_error(
+                    "lazy_load can't be combined with write_protect or dedup");
+        }
+        lazy_ = FileCacheLazy::Create(options_.lazy_readahead_pages);
+    }
+    if (options_.numa_placement != kNumaNone) {
+        numa_pool_ = FileCacheNumaPool::Create(FILE_SIZE);
+    }
+    if (!options_.trace_path.empty()) {
+        tracer_.reset(new FileCacheTracer(options_.trace_path));
+    }
+    if (!options_.wal_path.empty()) {
+        //Apply whatever the last run logged before starting over
+        counters_.Add(FileCacheCounters::kWalRecoveredBatches,
+                      FileCacheWal::Recover(options_.wal_path));
+        wal_.reset(new FileCacheWal(options_.wal_path));
+        next_checkpoint_ = options_.wal_checkpoint_bytes;
+    }
+    if (!options_.l2_path.empty()) {
+        l2_.reset(new FileCacheL2(options_.l2_path, options_.l2_bytes,
+                                  FILE_SIZE, options_.l2_write_budget));
+    }
+    if (options_.durability == kDurabilityGroupCommit ||
+        (!options_.index_path.empty() && options_.index_interval_ms > 0) ||
+        options_.compress) {
+        background_ = std::thread(&FileCacheImpl::background_loop, this);
+    }
+    if (!options_.index_path.empty()) {
+        load_index();
+        int threads = std::min((int)prefetch_list_.size(),
+                               options_.prefetch_threads);
+        for (int i = 0; i < threads; i++) {
+            prefetchers_.push_back(
+                    std::thread(&FileCacheImpl::prefetch_loop, this));
+        }
+    }
+}
+
 const char *
 FileCacheImpl::FileData(const std::string& file_name)
 {
+    if (tracer_) {
+        tracer_->Record(kTraceFileData, file_name);
+    }
+    uint64_t hash = 0;
+    FrontCacheSlot *slot = nullptr;
+    if (options_.front_cache) {
+        hash = FileCacheHash64(file_name.data(), file_name.size());
+        slot = &front_cache[hash % kFrontCacheSlots];
+        if (slot->cache_id == cache_id_ && slot->hash == hash &&
+            slot->generation == generation_.load(std::memory_order_acquire) &&
+            slot->name == file_name) {
+            counters_.Add(FileCacheCounters::kFrontCacheHits);
+            return slot->data;
+        }
+    }
     std::lock_guard<std::mutex> lock(m_);
     auto fitr = file_cache_.find(file_name);
     if (fitr == file_cache_.end()) {
         return nullptr;
     }
-    return fitr->second.file_buf_.get();
+    //Writers see the write session in progress, everyone else the
+    //published version. Drafts stay out of the front cache, which can't
+    //tell the threads apart.
+    const CacheEntry& ce = fitr->second;
+    bool draft = ce.draft_buf_ && ce.writers_.count(std::this_thread::get_id());
+    const char *data = draft ? ce.draft_buf_.get() : ce.file_buf_.get();
+    if (slot != nullptr && !draft) {
+        slot->cache_id = cache_id_;
+        slot->generation = generation_.load(std::memory_order_relaxed);
+        slot->hash = hash;
+        slot->name = file_name;
+        slot->data = data;
+    }
+    return data;
 }
 
 char *
 FileCacheImpl::MutableFileData(const std::string& file_name)
 {
+    if (tracer_) {
+        tracer_->Record(kTraceMutableFileData, file_name);
+    }
     std::lock_guard<std::mutex> lock(m_);
     auto fitr = file_cache_.find(file_name);
-    if (fitr == file_cache_.end()) {
+    if (fitr == file_cache_.end() || fitr->second.write_pins_ == 0) {
+        return nullptr;
+    }
+    if (options_.snapshot_reads || fitr->second.in_txn_) {
+        return draft_buffer(fitr->second, ~(uint64_t)0 >> (64 - DIRTY_PAGES));
+    }
+    if (!copy_on_write(fitr->second)) {
         return nullptr;
     }
-    //Mark the cache as dirty
-    fitr->second.dirty_ = true;
+    //Mark the cache as dirty, unless page faults will tell us exactly
+    if (!fitr->second.write_protected_) {
+        mark_dirty(fitr->second, ~(uint64_t)0 >> (64 - DIRTY_PAGES));
+    }
     return fitr->second.file_buf_.get();
 }
 
+char *
+FileCacheImpl::MutableFileRange(const std::string& file_name, size_t offset,
+                                size_t len)
+{
+    if (tracer_) {
+        tracer_->Record(kTraceMutableFileData, file_name);
+    }
+    if (offset > FILE_SIZE || len > FILE_SIZE - offset) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    auto fitr = file_cache_.find(file_name);
+    if (fitr == file_cache_.end() || fitr->second.write_pins_ == 0) {
+        return nullptr;
+    }
+    //Only the pages the range touches
+    uint64_t pages = 0;
+    if (len > 0) {
+        size_t first = offset / DIRTY_PAGE_SIZE;
+        size_t last = (offset + len - 1) / DIRTY_PAGE_SIZE;
+        pages = (~(uint64_t)0 >> (63 - last)) & (~(uint64_t)0 << first);
+    }
+    if (options_.snapshot_reads || fitr->second.in_txn_) {
+        char *draft = draft_buffer(fitr->second, pages);
+        return draft ? draft + offset : nullptr;
+    }
+    if (!copy_on_write(fitr->second)) {
+        return nullptr;
+    }
+    if (pages != 0 && !fitr->second.write_protected_) {
+        mark_dirty(fitr->second, pages);
+    }
+    return fitr->second.file_buf_.get() + offset;
+}
+
 /*evict_cache_entries
  * Input: Number of empty cache entries being sought for pinning new files by evicting 
  *        existing cache entries
- * Output: Number of cache entries actually evicted
+ * Output: Number of cache entries actually evicted, and copies of those
+ *         bound for the L2 tier in 'demotions'
  */
 uint32_t
-FileCacheImpl::evict_cache_entries(int num_cache_entries)
+FileCacheImpl::evict_cache_entries(int num_cache_entries,
+                                   Demotions& demotions)
 {
     /*Need to evict some entries from the cache
     * 1) The entries which are not dirty and not pinned can be just erased
@@ -75,20 +272,26 @@ FileCacheImpl::evict_cache_entries(int num_cache_entries)
     auto cache_entries_evicted = 0;
     for (auto fitr = file_cache_.begin(); fitr != file_cache_.end();) {
         if (fitr->second.pin_count_ == 0) {
-            if (fitr->second.dirty_) {
-                ::lseek(fitr->second.fd_, 0, SEEK_SET);
-                int nbytes = ::write(fitr->second.fd_, 
-                        fitr->second.file_buf_.get(), FILE_SIZE);
-                if (nbytes < 0) {
-                    //File write failed
-                    std::ostringstream err_str;
-                    err_str << "Error writing file " << fitr->first
-                            << " : " << strerror(errno);
-                    fprintf(stderr, "%s\n", err_str.str().c_str());
+            if (prepare_write_back(fitr->second)) {
+                //The log has to be on storage before the pages are
+                if (wal_ && !wal_->Sync(fitr->second.wal_lsn_)) {
+                    counters_.Add(FileCacheCounters::kIoErrors);
+                }
+                if (write_back_cache_entry(fitr->first, fitr->second)) {
+                    make_durable(fitr->first, fitr->second);
+                    demote_cache_entry(fitr->first, fitr->second, demotions);
                 }
+                counters_.Add(FileCacheCounters::kDirtyEvictions);
+            } else {
+                demote_cache_entry(fitr->first, fitr->second, demotions);
+                counters_.Add(FileCacheCounters::kCleanEvictions);
             }
             
+            release_buffer(fitr->second.retired_buf_);
+            release_buffer(fitr->second.file_buf_);
             file_cache_.erase(fitr++);
+            bump_generation();
+            resident_entries_.fetch_sub(1, std::memory_order_relaxed);
             cache_entries_evicted++;
             if (cache_entries_evicted == num_cache_entries) {
                //Enough entries evicted
@@ -101,161 +304,1910 @@ FileCacheImpl::evict_cache_entries(int num_cache_entries)
     return cache_entries_evicted;
 }
 
-/*add_cache_entry
- * Input: filename to be added to the cache
+void
+FileCacheImpl::collect_write_faults(CacheEntry& ce)
+{
+    if (ce.write_protected_ && ce.fault_pages_.load() != 0) {
+        mark_dirty(ce, ce.fault_pages_.exchange(0));
+        FileCacheWriteProtect::Protect(ce.file_buf_.get(), FILE_SIZE);
+    }
+}
+
+/*prepare_write_back
+ * Input: cache entry about to be evicted or flushed
+ * Output: true if the entry has pages that need writing. Pages caught by
+ *         the write protect handler are folded into dirty_pages_ by
+ *         collect_write_faults() (and the buffer re-armed, before its
+ *         contents are looked at, so a store racing with the write-back
+ *         faults again), then pages that did not actually change are
+ *         dropped.
+ */
+bool
+FileCacheImpl::prepare_write_back(CacheEntry& ce)
+{
+    collect_write_faults(ce);
+    if (ce.dirty() && options_.clean_check != kCleanCheckNone) {
+        drop_unchanged_pages(ce);
+    }
+    return ce.dirty();
+}
+
+/*drop_unchanged_pages
+ * Clears the dirty bits of pages that still match the clean copy taken
+ * when they were last read or written. An entry left with no dirty pages
+ * becomes clean without any I/O.
  */
 void
-FileCacheImpl::add_cache_entry(const std::string& file_name)
+FileCacheImpl::drop_unchanged_pages(CacheEntry& ce)
 {
-    int fd = ::open(file_name.c_str(), O_RDWR | O_CREAT, 0777);
-    if (fd < 0) {            
-        //file open failed
-        std::ostringstream err_str;            
-        err_str << "Error opening file " << file_name
-        << " : " << strerror(errno);
-        fprintf(stderr, "%s\n", err_str.str().c_str());
-        return;
-    } else {
-        //Read from the file and create a cache entry
-        std::shared_ptr<char> buf(new char[FILE_SIZE]());
-        memset(buf.get(), '0', FILE_SIZE);
-        ::lseek(fd, 0, SEEK_SET);
-        int nbytes = ::read(fd, buf.get(), FILE_SIZE);
-        if (nbytes < 0) {
-           //File read failed
-           std::ostringstream err_str;
-           err_str << "Error reading file " << file_name
-                   << " : " << strerror(errno);
-           fprintf(stderr, "%s\n", err_str.str().c_str());
-           ::close(fd);
-           return;
-        } else {
-           file_cache_.insert(std::make_pair(file_name, CacheEntry(buf, 1, fd)));
+    uint64_t pages = ce.dirty_pages_;
+    for (int page = 0; page < DIRTY_PAGES; page++) {
+        if (!(pages & ((uint64_t)1 << page))) {
+            continue;
         }
+        size_t offset = (size_t)page * DIRTY_PAGE_SIZE;
+        size_t len = std::min((size_t)DIRTY_PAGE_SIZE, FILE_SIZE - offset);
+        const char *data = ce.file_buf_.get() + offset;
+        bool unchanged = (options_.clean_check == kCleanCheckShadow) ?
+            FileCacheBuffersEqual(data, ce.shadow_buf_.get() + offset, len) :
+            FileCacheHash64(data, len) == ce.page_hash_[page];
+        if (unchanged) {
+            pages &= ~((uint64_t)1 << page);
+            counters_.Add(FileCacheCounters::kSkippedWriteBackBytes, len);
+        }
+    }
+    if (pages == 0) {
+        counters_.Add(FileCacheCounters::kSkippedWriteBacks);
+        dirty_entries_.fetch_sub(1, std::memory_order_relaxed);
     }
-    return;
+    ce.dirty_pages_ = pages;
 }
 
-/*fill_up_cache fill all available cache entries 
- * Input: set of filenames not yet pinned to be added to the cache
- * As each entry entry from the input set gets pinned, it is removed from
- * the set
+/*save_clean_copy
+ * Input: cache entry and the pages whose buffer contents now match storage
  */
 void
-FileCacheImpl::fill_up_cache(std::set<std::string>& files_not_pinned)
+FileCacheImpl::save_clean_copy(CacheEntry& ce, uint64_t pages)
 {
-    int empty_cache_entries = max_cache_entries_ - file_cache_.size();
-    //Fill up the cache    
-    for (auto fnpitr = files_not_pinned.begin(); 
-            (fnpitr != files_not_pinned.end()) && (empty_cache_entries > 0);) {
-        add_cache_entry(*fnpitr);
-        empty_cache_entries--; 
-        files_not_pinned.erase(fnpitr++);
-        if (files_not_pinned.empty()) {
-            //all done,
+    if (options_.clean_check == kCleanCheckNone) {
+        return;
+    }
+    if (options_.clean_check == kCleanCheckShadow) {
+        if (is_zero_page(ce.file_buf_)) {
+            //Storage holds zeros, and so does the zero page
+            ce.shadow_buf_ = ce.file_buf_;
             return;
         }
+        if (!ce.shadow_buf_ || is_zero_page(ce.shadow_buf_)) {
+            std::shared_ptr<char> shadow(new char[FILE_SIZE],
+                                         std::default_delete<char[]>());
+            if (ce.shadow_buf_) {
+                memcpy(shadow.get(), ce.shadow_buf_.get(), FILE_SIZE);
+            }
+            ce.shadow_buf_ = shadow;
+        }
+    }
+    for (int page = 0; page < DIRTY_PAGES; page++) {
+        if (!(pages & ((uint64_t)1 << page))) {
+            continue;
+        }
+        size_t offset = (size_t)page * DIRTY_PAGE_SIZE;
+        size_t len = std::min((size_t)DIRTY_PAGE_SIZE, FILE_SIZE - offset);
+        if (options_.clean_check == kCleanCheckShadow) {
+            memcpy(ce.shadow_buf_.get() + offset, ce.file_buf_.get() + offset,
+                   len);
+        } else {
+            ce.page_hash_[page] = FileCacheHash64(ce.file_buf_.get() + offset,
+                                                  len);
+        }
     }
-    
 }
 
-void
-FileCacheImpl::PinFiles(const std::vector<std::string>& file_vec)
+/*next_page_run
+ * Input: page bitmap
+ * Output: false if it is empty, otherwise the byte range of its first run
+ *         of adjacent pages, which is removed from the bitmap
+ */
+static bool
+next_page_run(uint64_t& pages, size_t& offset, size_t& len)
 {
-    /* unique_lock needs to be used instead of lock_guard because
-     * we may need to wait on condition variable
-     */
-    std::unique_lock<std::mutex> lock(m_);
-    if (file_vec.size() > max_cache_entries_) {
-        throw std::runtime_error("Number of files being pinned exceed cache size");
+    if (pages == 0) {
+        return false;
     }
-    
-    //Gather files not yet pinned from file_vec in this set
-    std::set<std::string> files_not_pinned;
-    //for files already pinned just increase the pin count
-    for (auto file_name : file_vec) {
-        auto fitr = file_cache_.find(file_name);
-        if (fitr != file_cache_.end()) {
-            fitr->second.pin_count_++;
+    int first = __builtin_ctzll(pages);
+    int end = first;
+    while (end < DIRTY_PAGES && (pages & ((uint64_t)1 << end))) {
+        end++;
+    }
+    pages &= ~(uint64_t)0 << end;
+    offset = (size_t)first * DIRTY_PAGE_SIZE;
+    len = std::min((size_t)end * DIRTY_PAGE_SIZE, (size_t)FILE_SIZE) - offset;
+    return true;
+}
+
+/*write_back_cache_entry
+ * Input: name and cache entry of a dirty buffer
+ * Output: true if the buffer made it to storage. Only the dirty pages are
+ *         written, one pwrite() per run of adjacent dirty pages. The entry
+ *         is marked clean either way so that a failing file cannot wedge
+ *         the cache.
+ */
+bool
+FileCacheImpl::write_back_cache_entry(const std::string& file_name,
+                                      CacheEntry& ce)
+{
+    FileCacheLatencyTimer timer(write_back_latency_);
+    bool written = true;
+    uint64_t pages = ce.dirty_pages_;
+    size_t offset, len;
+    while (written && next_page_run(pages, offset, len)) {
+        while (len > 0) {
+            ssize_t nbytes = ::pwrite(ce.fd_, ce.file_buf_.get() + offset,
+                                      len, offset);
+            if (nbytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                //File write failed
+                std::ostringstream err_str;
+                err_str << "Error writing file " << file_name
+                        << " : " << strerror(errno);
+                fprintf(stderr, "%s\n", err_str.str().c_str());
+                counters_.Add(FileCacheCounters::kIoErrors);
+                written = false;
+                break;
+            }
+            counters_.Add(FileCacheCounters::kWriteBackBytes, nbytes);
+            offset += nbytes;
+            len -= nbytes;
+        }
+    }
+    if (written && ce.short_file_) {
+        //Give it the full size, the pages that weren't dirty read as zeros
+        if (::ftruncate(ce.fd_, FILE_SIZE) < 0) {
+            counters_.Add(FileCacheCounters::kIoErrors);
         } else {
-            files_not_pinned.insert(file_name);
+            ce.short_file_ = false;
         }
     }
-    
-    //Fill up the cache, if there are any entries available
-    fill_up_cache(files_not_pinned);
-    if (files_not_pinned.empty()) {
-        //All done
+    if (written) {
+        counters_.Add(FileCacheCounters::kWriteBacks);
+        save_clean_copy(ce, ce.dirty_pages_);
+    }
+    write_back_seq_.fetch_add(1, std::memory_order_relaxed);
+    ce.dirty_pages_ = 0;
+    ce.unlogged_pages_ = 0;
+    ce.logged_pages_ = 0;
+    dirty_entries_.fetch_sub(1, std::memory_order_relaxed);
+    return written;
+}
+
+/*alloc_file_buf
+ * Input: NUMA node to put it on, -1 for no placement
+ * Output: an uninitialized FILE_SIZE buffer, or null if the write protect
+ *         mapping or the pool could not provide one
+ */
+std::shared_ptr<char>
+FileCacheImpl::alloc_file_buf(int node)
+{
+    if (!options_.write_protect) {
+        if (numa_pool_ && node >= 0) {
+            return numa_pool_->Allocate(node);
+        }
+        return std::shared_ptr<char>(new char[FILE_SIZE],
+                                     std::default_delete<char[]>());
+    }
+    char *buf = FileCacheWriteProtect::Allocate(FILE_SIZE);
+    if (buf == nullptr) {
+        return std::shared_ptr<char>();
+    }
+    if (node >= 0) {
+        FileCacheNumaPool::Bind(buf, FILE_SIZE, node);
+    }
+    return std::shared_ptr<char>(buf, [](char *p) {
+        FileCacheWriteProtect::Unregister(p);
+        FileCacheWriteProtect::Free(p, FILE_SIZE);
+    });
+}
+
+/*dedup_buffer
+ * Input: freshly loaded buffer, not the zero page
+ * Output: 'buf' replaced by the buffer in use with the same contents, if
+ *         there is one. Otherwise 'buf' goes into the table.
+ */
+void
+FileCacheImpl::dedup_buffer(std::shared_ptr<char>& buf)
+{
+    uint64_t hash = FileCacheHash64(buf.get(), FILE_SIZE);
+    std::lock_guard<std::mutex> lock(dedup_m_);
+    std::weak_ptr<char>& slot = dedup_[hash];
+    std::shared_ptr<char> match = slot.lock();
+    if (!match) {
+        slot = buf;
+    } else if (FileCacheBuffersEqual(match.get(), buf.get(), FILE_SIZE)) {
+        buf = match;
+        counters_.Add(FileCacheCounters::kDedupHits);
+        dedup_saved_bytes_.fetch_add(FILE_SIZE, std::memory_order_relaxed);
+    }
+    //A hash collision leaves 'buf' out of the table, unshared
+}
+
+/*claim_buffer
+ * Input: buffer of an entry about to be written to
+ * Output: true if no other entry shares it. It is then out of the dedup
+ *         table, so it can be written in place.
+ */
+bool
+FileCacheImpl::claim_buffer(std::shared_ptr<char>& buf)
+{
+    if (is_zero_page(buf)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(dedup_m_);
+    if (buf.use_count() > 1) {
+        return false;
+    }
+    auto ditr = dedup_.find(FileCacheHash64(buf.get(), FILE_SIZE));
+    if (ditr != dedup_.end() && ditr->second.lock() == buf) {
+        dedup_.erase(ditr);
+    }
+    return true;
+}
+
+/*release_buffer
+ * Input: buffer an entry or a prefetcher stops using, which is reset
+ */
+void
+FileCacheImpl::release_buffer(std::shared_ptr<char>& buf)
+{
+    if (!options_.dedup || !buf || is_zero_page(buf)) {
+        buf.reset();
         return;
     }
-    
-    //Cache full, need to evict some entries to proceed
-    while (!files_not_pinned.empty()) {        
-        while (!cache_entries_evictable()) {
-            cv_.wait(lock);
+    std::lock_guard<std::mutex> lock(dedup_m_);
+    if (buf.use_count() > 1) {
+        dedup_saved_bytes_.fetch_sub(FILE_SIZE, std::memory_order_relaxed);
+    } else {
+        //Last user, don't leave a dangling slot behind
+        auto ditr = dedup_.find(FileCacheHash64(buf.get(), FILE_SIZE));
+        if (ditr != dedup_.end() && ditr->second.lock() == buf) {
+            dedup_.erase(ditr);
         }
-        //Check if any of the files we wish to pin got pinned while we were blocked
-        for (auto fnpitr = files_not_pinned.begin(); 
-                fnpitr != files_not_pinned.end();) {
-            auto fitr = file_cache_.find(*fnpitr);
-            if (fitr != file_cache_.end()) {
-                fitr->second.pin_count_++;
-                files_not_pinned.erase(fnpitr++);
-            } else {
-                ++fnpitr;
-            }
+    }
+    buf.reset();
+}
+
+/*copy_on_write
+ * Input: cache entry about to be handed out for writing, m_ held
+ * Output: false if its buffer is shared and no private one could be
+ *         allocated. Otherwise its buffer is now private, registered for
+ *         write protection when that is on.
+ */
+bool
+FileCacheImpl::copy_on_write(CacheEntry& ce)
+{
+    if (!ce.shared_buf_) {
+        return true;
+    }
+    if (!options_.dedup || !claim_buffer(ce.file_buf_)) {
+        std::shared_ptr<char> buf = alloc_file_buf(ce.numa_node_);
+        if (!buf) {
+            counters_.Add(FileCacheCounters::kIoErrors);
+            return false;
         }
-        //Try to pin the remaining ones
-        if (!files_not_pinned.empty()) {
-            auto cache_entries_evicted = evict_cache_entries(files_not_pinned.size());       
-            assert(cache_entries_evicted <= files_not_pinned.size());
-            fill_up_cache(files_not_pinned);
+        memcpy(buf.get(), ce.file_buf_.get(), FILE_SIZE);
+        if (ce.pin_count_ > ce.write_pins_) {
+            //Read pins were handed the shared buffer, keep it alive for them
+            ce.retired_buf_.swap(ce.file_buf_);
+        }
+        release_buffer(ce.file_buf_);
+        ce.file_buf_ = buf;
+        bump_generation();
+        counters_.Add(FileCacheCounters::kCopyOnWrites);
+    }
+    ce.shared_buf_ = false;
+    if (options_.write_protect) {
+        ce.write_protected_ = FileCacheWriteProtect::Register(
+                ce.file_buf_.get(), FILE_SIZE, DIRTY_PAGE_SIZE,
+                &ce.fault_pages_);
+    }
+    return true;
+}
+
+/*draft_buffer
+ * Input: write pinned entry and the pages about to be written, m_ held
+ * Output: the entry's draft for FileCacheOptions::snapshot_reads, copied
+ *         from the current version on first use, or null if it could not
+ *         be allocated
+ */
+char *
+FileCacheImpl::draft_buffer(CacheEntry& ce, uint64_t pages)
+{
+    if (!ce.draft_buf_) {
+        std::shared_ptr<char> buf = alloc_file_buf(ce.numa_node_);
+        if (!buf) {
+            counters_.Add(FileCacheCounters::kIoErrors);
+            return nullptr;
         }
+        memcpy(buf.get(), ce.file_buf_.get(), FILE_SIZE);
+        ce.draft_buf_ = buf;
+        bump_generation();
     }
+    ce.draft_pages_ |= pages;
+    return ce.draft_buf_.get();
 }
 
+/*publish_draft
+ * Input: entry whose last write pin was just dropped, m_ held
+ * Makes the draft the version read pins get and marks its pages dirty.
+ * The replaced version waits in retired_versions_ for readers that may
+ * still hold it.
+ */
 void
-FileCacheImpl::UnpinFiles(const std::vector<std::string>& file_vec)
+FileCacheImpl::publish_draft(CacheEntry& ce)
 {
-    std::lock_guard<std::mutex> lock(m_);
-    bool cache_entry_evictable = false;
-    for (auto file_name : file_vec) {
-        auto fitr = file_cache_.find(file_name);
-        if (fitr != file_cache_.end()) {
-            // Deduct from the pin count, remove if it is 0
-            fitr->second.pin_count_--;
-            if (fitr->second.pin_count_ == 0) {
-                cache_entry_evictable = true;
-            }
+    if (!ce.draft_buf_) {
+        return;
+    }
+    ce.file_buf_.swap(ce.draft_buf_);
+    bump_generation();
+    retired_versions_.push_back(
+            std::make_pair(snapshot_epoch_++, std::shared_ptr<char>()));
+    retired_versions_.back().second.swap(ce.draft_buf_);
+    snapshot_versions_.fetch_add(1, std::memory_order_relaxed);
+    //The draft is private and nobody stores to it behind our back
+    ce.shared_buf_ = false;
+    ce.write_protected_ = false;
+    if (ce.draft_pages_ != 0) {
+        mark_dirty(ce, ce.draft_pages_);
+    }
+    ce.draft_pages_ = 0;
+    counters_.Add(FileCacheCounters::kSnapshotPublishes);
+}
+
+/*apply_draft
+ * Input: entry of a committing transaction, m_ held
+ * With snapshot reads the draft is published as a new version. Otherwise
+ * its pages are copied into the buffer in place, which read pins see.
+ */
+void
+FileCacheImpl::apply_draft(CacheEntry& ce)
+{
+    if (!ce.draft_buf_) {
+        return;
+    }
+    if (options_.snapshot_reads) {
+        publish_draft(ce);
+        return;
+    }
+    if (ce.shared_buf_) {
+        //The draft is a private copy already, it takes the shared
+        //buffer's place the way copy_on_write() would
+        if (ce.pin_count_ > ce.write_pins_) {
+            ce.retired_buf_.swap(ce.file_buf_);
+        }
+        release_buffer(ce.file_buf_);
+        ce.file_buf_ = ce.draft_buf_;
+        ce.shared_buf_ = false;
+        if (options_.write_protect) {
+            ce.write_protected_ = FileCacheWriteProtect::Register(
+                    ce.file_buf_.get(), FILE_SIZE, DIRTY_PAGE_SIZE,
+                    &ce.fault_pages_);
+        }
+    } else {
+        uint64_t pages = ce.draft_pages_;
+        size_t offset, len;
+        while (next_page_run(pages, offset, len)) {
+            memcpy(ce.file_buf_.get() + offset, ce.draft_buf_.get() + offset,
+                   len);
         }
     }
-    if (cache_entry_evictable) {
-        //Wake up threads waiting to pin other files
-        cv_.notify_all();
+    if (ce.draft_pages_ != 0) {
+        mark_dirty(ce, ce.draft_pages_);
     }
+    ce.draft_buf_.reset();
+    ce.draft_pages_ = 0;
+    bump_generation();
 }
 
+/*reclaim_versions
+ * Frees the replaced versions no reader can hold: those replaced before
+ * the epoch of the oldest thread still holding read pins.
+ */
+void
+FileCacheImpl::reclaim_versions()
+{
+    uint64_t oldest = snapshot_epoch_;
+    for (const auto& reader : readers_) {
+        oldest = std::min(oldest, reader.second.epoch);
+    }
+    while (!retired_versions_.empty() &&
+           retired_versions_.front().first < oldest) {
+        release_buffer(retired_versions_.front().second);
+        retired_versions_.pop_front();
+        snapshot_versions_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
 
-FileCacheImpl::CacheEntry::~CacheEntry()
-{ 
-    if (pin_count_ == 0) {
-        if (dirty_) {
-            ::lseek(fd_, 0, SEEK_SET);
-            int nbytes = ::write(fd_, file_buf_.get(), FILE_SIZE);
-            if (nbytes < 0) {
-                //File write failed
-                std::ostringstream err_str;
-                err_str << "Error writing file " 
-                        << " : " << strerror(errno);
-                fprintf(stderr, "%s\n", err_str.str().c_str());
-            }
-        }   
-        //Cache entry is being flushed, close the fd if the pincount is zero
-    
-        /* We dont want to close fd_ without checking pin_count_ because the 
-         * destructors for these objects can called for temporaries being constructed
-         * on the fly
-         */  
-        ::close(fd_);
+/*load_file
+ * Input: filename, whether to create it if it doesn't exist and whether the
+ *        L2 tier may serve it
+ * Output: open fd, a filled buffer and the number of bytes the file has on
+ *         storage, or -1 on failure. Files that are new or all zero get
+ *         the shared zero page instead of a buffer of their own. Touches no
+ *         cache state, so prefetching can call it without m_.
+ */
+int
+FileCacheImpl::load_file(const std::string& file_name, bool create,
+                         bool use_l2, std::shared_ptr<char>& buf,
+                         size_t& file_bytes)
+{
+    int fd = ::open(file_name.c_str(), O_RDWR | (create ? O_CREAT : 0), 0777);
+    if (fd < 0) {            
+        if (create || errno != ENOENT) {
+            //file open failed
+            std::ostringstream err_str;            
+            err_str << "Error opening file " << file_name
+            << " : " << strerror(errno);
+            fprintf(stderr, "%s\n", err_str.str().c_str());
+            counters_.Add(FileCacheCounters::kIoErrors);
+        }
+        return -1;
+    }
+    //Read from the file
+    int node = NumaNode(file_name);
+    buf = alloc_file_buf(node);
+    if (!buf) {
+        counters_.Add(FileCacheCounters::kIoErrors);
+        ::close(fd);
+        return -1;
+    }
+    bool taken = options_.compress && take_compressed(file_name, buf.get());
+    if (!taken && use_l2 && l2_ && l2_->Take(file_name, buf.get())) {
+        counters_.Add(FileCacheCounters::kL2Hits);
+        taken = true;
+    }
+    if (taken) {
+        //Demoted and compressed entries were clean, so the file on storage
+        //still has its old size, which decides whether write-back has to
+        //extend it
+        if (!stored_bytes(file_name, fd, file_bytes)) {
+            ::close(fd);
+            return -1;
+        }
+    } else if (lazy_ && lazy_file_buf(file_name, fd, node, buf, file_bytes)) {
+        //Pages are read on first touch, nothing to look at yet
+        return fd;
+    } else {
+        ::lseek(fd, 0, SEEK_SET);
+        int nbytes = ::read(fd, buf.get(), FILE_SIZE);
+        if (nbytes < 0) {
+           //File read failed
+           std::ostringstream err_str;
+           err_str << "Error reading file " << file_name
+                   << " : " << strerror(errno);
+           fprintf(stderr, "%s\n", err_str.str().c_str());
+           counters_.Add(FileCacheCounters::kIoErrors);
+           ::close(fd);
+           return -1;
+        }
+        //New or short file, the rest reads as zeros. It is extended to
+        //the full size when first written back, not here, so files that
+        //are only ever read cost no writes.
+        memset(buf.get() + nbytes, 0, FILE_SIZE - nbytes);
+        file_bytes = nbytes;
     }
+    if (file_bytes == 0 || FileCacheBufferIsZero(buf.get(), FILE_SIZE)) {
+        buf = zero_page();
+        counters_.Add(FileCacheCounters::kZeroPageLoads);
+    } else if (options_.dedup) {
+        dedup_buffer(buf);
+    }
+    return fd;
+}
+
+/*lazy_file_buf
+ * Input: filename, its open fd and NUMA node, for FileCacheOptions::lazy_load
+ * Output: true with 'buf' replaced by a lazily filled mapping of the file
+ *         and its size in 'file_bytes'. False for an empty file, which
+ *         goes on the zero page as usual, or if fstat() or the mapping
+ *         failed, in which case the file is read now.
+ */
+bool
+FileCacheImpl::lazy_file_buf(const std::string& file_name, int fd, int node,
+                             std::shared_ptr<char>& buf, size_t& file_bytes)
+{
+    size_t stored;
+    if (!stored_bytes(file_name, fd, stored) || stored == 0) {
+        return false;
+    }
+    std::shared_ptr<char> lazy_buf = lazy_->Map(fd, FILE_SIZE, stored);
+    if (!lazy_buf) {
+        counters_.Add(FileCacheCounters::kIoErrors);
+        return false;
+    }
+    if (node >= 0) {
+        FileCacheNumaPool::Bind(lazy_buf.get(), FILE_SIZE, node);
+    }
+    buf = lazy_buf;
+    file_bytes = stored;
+    return true;
+}
+
+/*stored_bytes
+ * Input: filename and its open fd
+ * Output: true with the number of bytes the file has on storage, capped at
+ *         FILE_SIZE, in 'file_bytes'. False if fstat() failed.
+ */
+bool
+FileCacheImpl::stored_bytes(const std::string& file_name, int fd,
+                            size_t& file_bytes)
+{
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        std::ostringstream err_str;
+        err_str << "Error reading file " << file_name
+                << " : " << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        counters_.Add(FileCacheCounters::kIoErrors);
+        return false;
+    }
+    file_bytes = std::min<size_t>(st.st_size, FILE_SIZE);
+    return true;
+}
+
+/*insert_cache_entry
+ * Input: filename and what load_file() returned for it, initial pin count
+ * Output: the new cache entry, m_ held
+ */
+FileCacheImpl::CacheEntry&
+FileCacheImpl::insert_cache_entry(const std::string& file_name,
+                                  std::shared_ptr<char> buf, int fd,
+                                  size_t file_bytes, uint32_t pin_count)
+{
+    auto fitr = file_cache_.emplace(std::piecewise_construct,
+            std::forward_as_tuple(file_name),
+            std::forward_as_tuple(buf, pin_count, fd)).first;
+    CacheEntry& ce = fitr->second;
+    if (demoting_.count(file_name)) {
+        //Back in DRAM before its L2 copy landed, see admit_demotions()
+        demote_stale_.insert(file_name);
+    }
+    ce.numa_node_ = NumaNode(file_name);
+    ce.new_file_ = (file_bytes == 0);
+    ce.short_file_ = (file_bytes < FILE_SIZE);
+    ce.shared_buf_ = is_zero_page(buf) || options_.dedup;
+    save_clean_copy(ce, ~(uint64_t)0 >> (64 - DIRTY_PAGES));
+    if (options_.write_protect && !ce.shared_buf_) {
+        ce.write_protected_ = FileCacheWriteProtect::Register(
+                buf.get(), FILE_SIZE, DIRTY_PAGE_SIZE, &ce.fault_pages_);
+    }
+    resident_entries_.fetch_add(1, std::memory_order_relaxed);
+    if (pin_count != 0) {
+        pinned_entries_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ce;
+}
+
+//Entries compress_sweep() copies out per hold of m_
+static const size_t kCompressBatch = 32;
+
+/*compress_sweep
+ * Moves unpinned, clean entries that were not pinned since the previous
+ * sweep out of file_cache_ and into the compressed pool, freeing their
+ * slots. Entries that don't shrink by at least an eighth stay as they
+ * are and are not tried again. Works in batches: victims are copied out
+ * under m_, compressed without it, and only moved to the pool if they are
+ * still cold, unpinned and clean by then.
+ */
+void
+FileCacheImpl::compress_sweep()
+{
+    struct Victim {
+        std::string name;
+        std::unique_ptr<char[]> buf;
+        std::string data;       //empty if it didn't compress well enough
+    };
+    uint64_t cold_clock;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        cold_clock = compress_clock_;
+        compress_clock_ = access_clock_;
+    }
+    auto is_victim = [cold_clock, this](CacheEntry& ce) {
+        return ce.pin_count_ == 0 && !ce.incompressible_ &&
+               ce.last_access_ <= cold_clock && !prepare_write_back(ce);
+    };
+    std::vector<char> out(FILE_SIZE);
+    //Name of the last entry looked at, the next batch starts after it
+    std::string resume;
+    bool started = false;
+    bool more = true;
+    while (more) {
+        std::vector<Victim> victims;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            auto fitr = started ? file_cache_.upper_bound(resume) :
+                                  file_cache_.begin();
+            for (; fitr != file_cache_.end() &&
+                   victims.size() < kCompressBatch; ++fitr) {
+                if (!is_victim(fitr->second)) {
+                    continue;
+                }
+                Victim victim;
+                victim.name = fitr->first;
+                victim.buf.reset(new char[FILE_SIZE]);
+                memcpy(victim.buf.get(), fitr->second.file_buf_.get(),
+                       FILE_SIZE);
+                victims.push_back(std::move(victim));
+            }
+            more = fitr != file_cache_.end();
+            if (more) {
+                resume = std::prev(fitr)->first;
+                started = true;
+            }
+        }
+        for (auto& victim : victims) {
+            size_t len = FileCacheLzCompress(victim.buf.get(), FILE_SIZE,
+                                             out.data(), FILE_SIZE * 7 / 8);
+            victim.data.assign(out.data(), len);
+        }
+        std::lock_guard<std::mutex> lock(m_);
+        for (const auto& victim : victims) {
+            auto fitr = file_cache_.find(victim.name);
+            //Pinned or dirtied in the meantime, the copy may be out of date
+            if (fitr == file_cache_.end() || !is_victim(fitr->second)) {
+                continue;
+            }
+            CacheEntry& ce = fitr->second;
+            if (victim.data.empty()) {
+                ce.incompressible_ = true;
+                continue;
+            }
+            counters_.Add(FileCacheCounters::kCompressions);
+            counters_.Add(FileCacheCounters::kCompressInBytes, FILE_SIZE);
+            counters_.Add(FileCacheCounters::kCompressOutBytes,
+                          victim.data.size());
+            store_compressed(victim.name, victim.data);
+            release_buffer(ce.retired_buf_);
+            release_buffer(ce.file_buf_);
+            file_cache_.erase(fitr);
+            bump_generation();
+            resident_entries_.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+/*store_compressed
+ * Input: filename and its compressed buffer, m_ held
+ * Output: the buffer in the compressed pool, the oldest entries dropped
+ *         if that takes the pool over its budget
+ */
+void
+FileCacheImpl::store_compressed(const std::string& file_name,
+                                const std::string& data)
+{
+    std::lock_guard<std::mutex> compressed_lock(compressed_m_);
+    CompressedEntry& entry = compressed_[file_name];
+    compressed_bytes_ += data.size() - entry.data.size();
+    if (entry.data.empty()) {
+        compressed_entries_.fetch_add(1, std::memory_order_relaxed);
+    }
+    entry.data = data;
+    entry.seq = ++compressed_seq_;
+    compressed_order_.push_back(std::make_pair(file_name, entry.seq));
+    //Oldest first out of the pool when it is over budget
+    while (compressed_bytes_ > options_.compress_bytes &&
+           !compressed_order_.empty()) {
+        auto oldest = compressed_order_.front();
+        compressed_order_.pop_front();
+        auto citr = compressed_.find(oldest.first);
+        if (citr != compressed_.end() &&
+            citr->second.seq == oldest.second) {
+            compressed_bytes_ -= citr->second.data.size();
+            compressed_.erase(citr);
+            compressed_entries_.fetch_sub(1, std::memory_order_relaxed);
+            counters_.Add(FileCacheCounters::kCleanEvictions);
+        }
+    }
+    compressed_bytes_gauge_.store(compressed_bytes_,
+                                  std::memory_order_relaxed);
+}
+
+/*take_compressed
+ * Input: filename and a FILE_SIZE buffer
+ * Output: true if the file was in the compressed pool, now decompressed
+ *         into 'buf' and removed from the pool
+ */
+bool
+FileCacheImpl::take_compressed(const std::string& file_name, char *buf)
+{
+    std::string data;
+    {
+        std::lock_guard<std::mutex> lock(compressed_m_);
+        auto citr = compressed_.find(file_name);
+        if (citr == compressed_.end()) {
+            return false;
+        }
+        data.swap(citr->second.data);
+        compressed_.erase(citr);
+        compressed_bytes_ -= data.size();
+        compressed_bytes_gauge_.store(compressed_bytes_,
+                                      std::memory_order_relaxed);
+        compressed_entries_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    FileCacheLatencyTimer timer(decompress_latency_);
+    if (!FileCacheLzDecompress(data.data(), data.size(), buf, FILE_SIZE)) {
+        return false;
+    }
+    counters_.Add(FileCacheCounters::kCompressedHits);
+    return true;
+}
+
+/*demote_cache_entry
+ * Input: clean entry being evicted, m_ held
+ * Output: if there is an L2 tier, a copy of its buffer added to
+ *         'demotions' for admit_demotions() to offer to it
+ */
+void
+FileCacheImpl::demote_cache_entry(const std::string& file_name,
+                                  CacheEntry& ce, Demotions& demotions)
+{
+    if (!l2_ || is_zero_page(ce.file_buf_)) {
+        //Reloading a zero page entry reads nothing worth caching
+        return;
+    }
+    std::shared_ptr<char> copy(new char[FILE_SIZE],
+                               std::default_delete<char[]>());
+    memcpy(copy.get(), ce.file_buf_.get(), FILE_SIZE);
+    demotions.push_back(std::make_pair(file_name, copy));
+    demoting_[file_name]++;
+}
+
+/*admit_demotions
+ * Input: lock on m_, held, and the copies evict_cache_entries() made
+ * Output: the copies offered to the L2 tier with m_ dropped, so the writes
+ *         don't hold up the cache. A file loaded again in the meantime may
+ *         have changed since, so its copy is dropped to keep the tier
+ *         exclusive of DRAM. m_ is held again on return.
+ */
+void
+FileCacheImpl::admit_demotions(std::unique_lock<std::mutex>& lock,
+                               Demotions& demotions)
+{
+    if (demotions.empty()) {
+        return;
+    }
+    lock.unlock();
+    for (const auto& demotion : demotions) {
+        switch (l2_->Insert(demotion.first, demotion.second.get())) {
+        case FileCacheL2::kAdmitted:
+            counters_.Add(FileCacheCounters::kL2Admissions);
+            break;
+        case FileCacheL2::kRejectedFirstSeen:
+        case FileCacheL2::kRejectedBudget:
+            counters_.Add(FileCacheCounters::kL2Rejections);
+            break;
+        case FileCacheL2::kWriteFailed:
+            counters_.Add(FileCacheCounters::kIoErrors);
+            break;
+        }
+    }
+    lock.lock();
+    for (const auto& demotion : demotions) {
+        const std::string& file_name = demotion.first;
+        if (demote_stale_.count(file_name)) {
+            l2_->Drop(file_name);
+        }
+        auto ditr = demoting_.find(file_name);
+        if (--ditr->second == 0) {
+            demoting_.erase(ditr);
+            demote_stale_.erase(file_name);
+        }
+    }
+}
+
+/*add_cache_entry
+ * Input: filename to be added to the cache, pinned, for writing or not
+ */
+void
+FileCacheImpl::add_cache_entry(const std::string& file_name, bool write)
+{
+    FileCacheLatencyTimer timer(fill_latency_);
+    std::shared_ptr<char> buf;
+    size_t file_bytes;
+    //With a demotion in flight the L2 copy may be about to go stale,
+    //storage is up to date
+    int fd = load_file(file_name, true, demoting_.count(file_name) == 0, buf,
+                       file_bytes);
+    if (fd < 0) {
+        return;
+    }
+    CacheEntry& ce = insert_cache_entry(file_name, buf, fd, file_bytes, 1);
+    if (write) {
+        ce.write_pins_ = 1;
+        add_writer(ce);
+    }
+    ce.accesses_ = 1;
+    ce.last_access_ = ++access_clock_;
+    counters_.Add(FileCacheCounters::kMisses);
+}
+
+/*fill_up_cache fill all available cache entries 
+ * Input: set of filenames not yet pinned to be added to the cache
+ * As each entry entry from the input set gets pinned, it is removed from
+ * the set
+ */
+void
+FileCacheImpl::fill_up_cache(std::set<std::string>& files_not_pinned,
+                             bool write)
+{
+    int empty_cache_entries = max_cache_entries_ - file_cache_.size();
+    //Fill up the cache    
+    for (auto fnpitr = files_not_pinned.begin(); 
+            (fnpitr != files_not_pinned.end()) && (empty_cache_entries > 0);) {
+        add_cache_entry(*fnpitr, write);
+        empty_cache_entries--; 
+        files_not_pinned.erase(fnpitr++);
+        if (files_not_pinned.empty()) {
+            //all done,
+            return;
+        }
+    }
+    
+}
+
+void
+FileCacheImpl::PinFiles(const std::vector<std::string>& file_vec)
+{
+    PinFilesForWrite(file_vec);
+}
+
+void
+FileCacheImpl::PinFilesForWrite(const std::vector<std::string>& file_vec)
+{
+    FileCacheLatencyTimer timer(pin_latency_);
+    if (tracer_) {
+        tracer_->Record(kTracePin, file_vec);
+    }
+    /* unique_lock needs to be used instead of lock_guard because
+     * we may need to wait on condition variable
+     */
+    std::unique_lock<std::mutex> lock(m_);
+    pin_files(lock, file_vec, true);
+}
+
+std::vector<const char *>
+FileCacheImpl::PinFilesForRead(const std::vector<std::string>& file_vec)
+{
+    FileCacheLatencyTimer timer(pin_latency_);
+    if (tracer_) {
+        tracer_->Record(kTracePinRead, file_vec);
+    }
+    std::unique_lock<std::mutex> lock(m_);
+    pin_files(lock, file_vec, false);
+    if (options_.snapshot_reads) {
+        ReaderSlot& slot = readers_[std::this_thread::get_id()];
+        if (slot.pins == 0) {
+            slot.epoch = snapshot_epoch_;
+        }
+        slot.pins += file_vec.size();
+    }
+    std::vector<const char *> bufs;
+    bufs.reserve(file_vec.size());
+    for (const auto& file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        bufs.push_back(fitr == file_cache_.end() ? nullptr :
+                       fitr->second.file_buf_.get());
+    }
+    return bufs;
+}
+
+/*pin_files
+ * Input: m_ held, files to pin and whether the pins are for writing
+ */
+void
+FileCacheImpl::pin_files(std::unique_lock<std::mutex>& lock,
+                         const std::vector<std::string>& file_vec, bool write)
+{
+    if (file_vec.size() > max_cache_entries_) {
+        throw std::runtime_error("Number of files being pinned exceed cache size");
+    }
+    
+    //Gather files not yet pinned from file_vec in this set
+    std::set<std::string> files_not_pinned;
+    //for files already pinned just increase the pin count
+    for (auto file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        if (fitr != file_cache_.end()) {
+            pin_cache_entry(fitr->second, write);
+        } else {
+            files_not_pinned.insert(file_name);
+        }
+    }
+    
+    //Fill up the cache, if there are any entries available
+    fill_up_cache(files_not_pinned, write);
+    if (files_not_pinned.empty()) {
+        //All done
+        return;
+    }
+    
+    //Cache full, need to evict some entries to proceed
+    while (!files_not_pinned.empty()) {        
+        if (!cache_entries_evictable()) {
+            auto wait_start = std::chrono::steady_clock::now();
+            while (!cache_entries_evictable()) {
+                cv_.wait(lock);
+            }
+            counters_.Add(FileCacheCounters::kWaitNs,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - wait_start).count());
+        }
+        //Check if any of the files we wish to pin got pinned while we were blocked
+        for (auto fnpitr = files_not_pinned.begin(); 
+                fnpitr != files_not_pinned.end();) {
+            auto fitr = file_cache_.find(*fnpitr);
+            if (fitr != file_cache_.end()) {
+                pin_cache_entry(fitr->second, write);
+                files_not_pinned.erase(fnpitr++);
+            } else {
+                ++fnpitr;
+            }
+        }
+        //Try to pin the remaining ones
+        if (!files_not_pinned.empty()) {
+            Demotions demotions;
+            auto cache_entries_evicted = evict_cache_entries(
+                    files_not_pinned.size(), demotions);
+            assert(cache_entries_evicted <= files_not_pinned.size());
+            fill_up_cache(files_not_pinned, write);
+            //Only after filling, so the freed entries go to this call
+            admit_demotions(lock, demotions);
+        }
+    }
+}
+
+void
+FileCacheImpl::UnpinFiles(const std::vector<std::string>& file_vec)
+{
+    unpin_files(file_vec, true);
+}
+
+void
+FileCacheImpl::UnpinFilesForRead(const std::vector<std::string>& file_vec)
+{
+    unpin_files(file_vec, false);
+}
+
+void
+FileCacheImpl::unpin_files(const std::vector<std::string>& file_vec,
+                           bool write)
+{
+    FileCacheLatencyTimer timer(unpin_latency_);
+    if (tracer_) {
+        tracer_->Record(write ? kTraceUnpin : kTraceUnpinRead, file_vec);
+    }
+    std::unique_lock<std::mutex> lock(m_);
+    uint64_t lsn = drop_pins(file_vec, write);
+    if (lsn != 0 && options_.durability == kDurabilitySync) {
+        //Outside m_ so that concurrent unpins share the sync
+        lock.unlock();
+        if (!wal_->Sync(lsn)) {
+            counters_.Add(FileCacheCounters::kIoErrors);
+        }
+    }
+}
+
+/*drop_writer
+ * Input: entry losing a write pin of the calling thread, m_ held
+ * Output: the thread no longer counts as its writer once that was its
+ *         last. Pins dropped by another thread than the one that took them
+ *         are settled when the last write pin goes. Invalidates front
+ *         caches while there is a draft.
+ */
+void
+FileCacheImpl::drop_writer(CacheEntry& ce)
+{
+    if (ce.write_pins_ <= 1) {
+        ce.writers_.clear();
+    } else {
+        auto witr = ce.writers_.find(std::this_thread::get_id());
+        if (witr != ce.writers_.end() && --witr->second == 0) {
+            ce.writers_.erase(witr);
+        }
+    }
+    //Which buffer FileData() returns to the thread may have changed
+    if (ce.draft_buf_) {
+        bump_generation();
+    }
+}
+
+/*drop_pins
+ * Input: m_ held, files to unpin and whether the pins were for writing
+ * Output: the log batch the pages they dirtied went into, 0 for none
+ */
+uint64_t
+FileCacheImpl::drop_pins(const std::vector<std::string>& file_vec,
+                         bool write)
+{
+    bool cache_entry_evictable = false;
+    for (auto file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        if (fitr != file_cache_.end()) {
+            // Deduct from the pin count, remove if it is 0
+            if (write) {
+                drop_writer(fitr->second);
+            }
+            if (write && --fitr->second.write_pins_ == 0) {
+                publish_draft(fitr->second);
+            }
+            fitr->second.pin_count_--;
+            if (fitr->second.pin_count_ == 0) {
+                pinned_entries_.fetch_sub(1, std::memory_order_relaxed);
+                cache_entry_evictable = true;
+            }
+        }
+    }
+    if (options_.snapshot_reads) {
+        if (!write) {
+            auto ritr = readers_.find(std::this_thread::get_id());
+            if (ritr != readers_.end()) {
+                ritr->second.pins -= std::min(ritr->second.pins,
+                                              file_vec.size());
+                if (ritr->second.pins == 0) {
+                    readers_.erase(ritr);
+                }
+            }
+        }
+        reclaim_versions();
+    }
+    //Still under m_, nobody can evict the entries before they are logged.
+    //Read pins can't have dirtied anything.
+    uint64_t lsn = 0;
+    if (wal_ && write) {
+        lsn = log_files(file_vec);
+    }
+    if (cache_entry_evictable) {
+        //Wake up threads waiting to pin other files
+        cv_.notify_all();
+    }
+    return lsn;
+}
+
+uint64_t
+FileCacheImpl::BeginTxn(const std::vector<std::string>& file_vec)
+{
+    if (!wal_) {
+        throw std::runtime_error("Transactions need a write-ahead log");
+    }
+    FileCacheLatencyTimer timer(pin_latency_);
+    if (tracer_) {
+        tracer_->Record(kTracePin, file_vec);
+    }
+    std::unique_lock<std::mutex> lock(m_);
+    //Claim all the files at once, so transactions can't deadlock
+    auto in_txn = [this](const std::string& file_name) {
+        return txn_files_.count(file_name) != 0;
+    };
+    while (std::any_of(file_vec.begin(), file_vec.end(), in_txn)) {
+        cv_.wait(lock);
+    }
+    txn_files_.insert(file_vec.begin(), file_vec.end());
+    pin_files(lock, file_vec, true);
+    for (const auto& file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        if (fitr != file_cache_.end()) {
+            fitr->second.in_txn_ = true;
+        }
+    }
+    uint64_t txn = ++next_txn_;
+    txns_[txn] = file_vec;
+    return txn;
+}
+
+/*take_txn
+ * Input: m_ held, id of an open transaction
+ * Output: its files, released from it. Throws for an unknown id.
+ */
+std::vector<std::string>
+FileCacheImpl::take_txn(uint64_t txn)
+{
+    auto titr = txns_.find(txn);
+    if (titr == txns_.end()) {
+        throw std::runtime_error("Unknown transaction");
+    }
+    std::vector<std::string> file_vec;
+    file_vec.swap(titr->second);
+    txns_.erase(titr);
+    for (const auto& file_name : file_vec) {
+        txn_files_.erase(file_name);
+        auto fitr = file_cache_.find(file_name);
+        if (fitr != file_cache_.end()) {
+            fitr->second.in_txn_ = false;
+        }
+    }
+    //Wake up BeginTxn() calls waiting for these files
+    cv_.notify_all();
+    return file_vec;
+}
+
+bool
+FileCacheImpl::Commit(uint64_t txn)
+{
+    FileCacheLatencyTimer timer(unpin_latency_);
+    std::unique_lock<std::mutex> lock(m_);
+    std::vector<std::string> file_vec = take_txn(txn);
+    if (tracer_) {
+        tracer_->Record(kTraceUnpin, file_vec);
+    }
+    for (const auto& file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        if (fitr != file_cache_.end()) {
+            apply_draft(fitr->second);
+        }
+    }
+    //All the pages go into one batch, so replay is all or nothing
+    uint64_t lsn = drop_pins(file_vec, true);
+    //Pages left unlogged mean the append failed
+    bool ok = std::none_of(file_vec.begin(), file_vec.end(),
+            [this](const std::string& file_name) {
+                auto fitr = file_cache_.find(file_name);
+                return fitr != file_cache_.end() &&
+                       fitr->second.unlogged_pages_ != 0;
+            });
+    counters_.Add(FileCacheCounters::kTxnCommits);
+    lock.unlock();
+    if (lsn != 0 && !wal_->Sync(lsn)) {
+        counters_.Add(FileCacheCounters::kIoErrors);
+        ok = false;
+    }
+    return ok;
+}
+
+void
+FileCacheImpl::Abort(uint64_t txn)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    std::vector<std::string> file_vec = take_txn(txn);
+    if (tracer_) {
+        tracer_->Record(kTraceUnpin, file_vec);
+    }
+    for (const auto& file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        if (fitr != file_cache_.end()) {
+            fitr->second.draft_buf_.reset();
+            fitr->second.draft_pages_ = 0;
+            bump_generation();
+        }
+    }
+    drop_pins(file_vec, true);
+    counters_.Add(FileCacheCounters::kTxnAborts);
+}
+
+bool
+FileCacheImpl::PinRange(const std::string& file_name, uint64_t offset,
+                        size_t len)
+{
+    FileCacheLatencyTimer timer(pin_latency_);
+    return ranges_->Pin(file_name, offset, len);
+}
+
+void
+FileCacheImpl::UnpinRange(const std::string& file_name, uint64_t offset,
+                          size_t len)
+{
+    FileCacheLatencyTimer timer(unpin_latency_);
+    ranges_->Unpin(file_name, offset, len);
+}
+
+const char *
+FileCacheImpl::FileRange(const std::string& file_name, uint64_t offset,
+                         size_t& len)
+{
+    return ranges_->Data(file_name, offset, len);
+}
+
+
+FileCacheImpl::CacheEntry::~CacheEntry()
+{ 
+    /* Entries are constructed in place in file_cache_ and only destroyed
+     * when evicted or when the cache goes away. Dirty buffers are written
+     * back by the owning FileCacheImpl before that.
+     */
+    ::close(fd_);
+}
+
+FileCacheImpl::~FileCacheImpl()
+{
+    //Both take m_, so stop them before taking it
+    prefetch_stop_ = true;
+    for (auto& prefetcher : prefetchers_) {
+        prefetcher.join();
+    }
+    if (background_.joinable()) {
+        {
+            std::lock_guard<std::mutex> background_lock(background_m_);
+            stopping_ = true;
+        }
+        background_cv_.notify_all();
+        background_.join();
+    }
+
+    {
+        //Flush all dirty buffers before the entries go away
+        std::lock_guard<std::mutex> lock(m_);
+        if (wal_ && !wal_->Sync(UINT64_MAX)) {
+            counters_.Add(FileCacheCounters::kIoErrors);
+        }
+        for (auto& ce : file_cache_) {
+            if (prepare_write_back(ce.second) &&
+                write_back_cache_entry(ce.first, ce.second)) {
+                make_durable(ce.first, ce.second);
+            }
+        }
+        if (wal_) {
+            //Everything is in place now, sync it and drop the log
+            checkpoint_wal();
+        }
+    }
+    if (options_.durability == kDurabilityGroupCommit) {
+        group_commit();
+    }
+    if (!options_.index_path.empty()) {
+        save_index();
+    }
+}
+
+/*physical_offset
+ * Input: open file
+ * Output: byte address of the file's first extent on its device, or 0 if
+ *         the file system doesn't tell (no FIEMAP, nothing allocated yet)
+ */
+static uint64_t
+physical_offset(int fd)
+{
+    //Room for the header and the single extent asked for
+    uint64_t req[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) /
+                 sizeof(uint64_t)];
+    memset(req, 0, sizeof(req));
+    struct fiemap *map = (struct fiemap *)req;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (::ioctl(fd, FS_IOC_FIEMAP, map) < 0 || map->fm_mapped_extents == 0) {
+        return 0;
+    }
+    return map->fm_extents[0].fe_physical;
+}
+
+static std::string
+parent_dir(const std::string& file_name)
+{
+    size_t slash = file_name.find_last_of('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    return slash == 0 ? "/" : file_name.substr(0, slash);
+}
+
+/*make_durable
+ * Input: entry just written back, m_ held
+ * Applies options_.durability to it. Errors are counted and reported but
+ * the entry stays clean, as for failed writes.
+ */
+void
+FileCacheImpl::make_durable(const std::string& file_name, CacheEntry& ce)
+{
+    if (wal_ && options_.durability != kDurabilitySync) {
+        //The checkpoint syncs it before dropping the log
+        int fd = ::dup(ce.fd_);
+        if (fd >= 0) {
+            checkpoint_files_.push_back(std::make_pair(fd, file_name));
+        } else {
+            sync_file(ce.fd_, file_name);
+        }
+    }
+    switch (options_.durability) {
+    case kDurabilityNone:
+        return;
+    case kDurabilitySync:
+        sync_file(ce.fd_, file_name);
+        if (ce.new_file_) {
+            sync_dir(parent_dir(file_name));
+        }
+        break;
+    case kDurabilityGroupCommit: {
+        //The entry may be evicted and its fd closed before the commit
+        int fd = ::dup(ce.fd_);
+        if (fd < 0) {
+            sync_file(ce.fd_, file_name);
+            if (ce.new_file_) {
+                sync_dir(parent_dir(file_name));
+            }
+            break;
+        }
+        std::lock_guard<std::mutex> lock(background_m_);
+        commit_files_.push_back(std::make_pair(fd, file_name));
+        if (ce.new_file_) {
+            commit_dirs_.insert(parent_dir(file_name));
+        }
+        break;
+    }
+    case kDurabilityAsync:
+        if (::sync_file_range(ce.fd_, 0, 0, SYNC_FILE_RANGE_WRITE) < 0) {
+            std::ostringstream err_str;
+            err_str << "Error starting writeback of " << file_name
+                    << " : " << strerror(errno);
+            fprintf(stderr, "%s\n", err_str.str().c_str());
+            counters_.Add(FileCacheCounters::kIoErrors);
+        }
+        return;
+    }
+    ce.new_file_ = false;
+}
+
+bool
+FileCacheImpl::sync_file(int fd, const std::string& file_name)
+{
+    counters_.Add(FileCacheCounters::kSyncs);
+    if (::fdatasync(fd) < 0) {
+        std::ostringstream err_str;
+        err_str << "Error syncing file " << file_name
+                << " : " << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        counters_.Add(FileCacheCounters::kIoErrors);
+        return false;
+    }
+    return true;
+}
+
+bool
+FileCacheImpl::sync_dir(const std::string& dir)
+{
+    counters_.Add(FileCacheCounters::kSyncs);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    bool synced = (fd >= 0 && ::fsync(fd) == 0);
+    if (!synced) {
+        std::ostringstream err_str;
+        err_str << "Error syncing directory " << dir
+                << " : " << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        counters_.Add(FileCacheCounters::kIoErrors);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return synced;
+}
+
+/*group_commit
+ * Syncs every file written back since the last commit, then the
+ * directories of new ones. Runs without m_.
+ */
+void
+FileCacheImpl::group_commit()
+{
+    std::vector<std::pair<int, std::string> > files;
+    std::set<std::string> dirs;
+    {
+        std::lock_guard<std::mutex> lock(background_m_);
+        files.swap(commit_files_);
+        dirs.swap(commit_dirs_);
+    }
+    if (wal_ && !wal_->Sync(UINT64_MAX)) {
+        counters_.Add(FileCacheCounters::kIoErrors);
+    }
+    for (const auto& file : files) {
+        sync_file(file.first, file.second);
+        ::close(file.first);
+    }
+    for (const auto& dir : dirs) {
+        sync_dir(dir);
+    }
+}
+
+/*log_files
+ * Input: files being unpinned, m_ held
+ * Output: LSN of the batch holding their unlogged pages, 0 if there was
+ *         nothing to log or the append failed (the pages then stay
+ *         unlogged and go with the next batch)
+ */
+uint64_t
+FileCacheImpl::log_files(const std::vector<std::string>& file_vec)
+{
+    std::vector<FileCacheWalRecord> records;
+    std::vector<CacheEntry *> entries;
+    uint64_t bytes = 0;
+    for (const auto& file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        if (fitr == file_cache_.end()) {
+            continue;
+        }
+        CacheEntry& ce = fitr->second;
+        collect_write_faults(ce);
+        uint64_t pages = ce.unlogged_pages_;
+        size_t offset, len;
+        while (next_page_run(pages, offset, len)) {
+            FileCacheWalRecord record;
+            record.name = &fitr->first;
+            record.offset = offset;
+            record.data = ce.file_buf_.get() + offset;
+            record.len = len;
+            records.push_back(record);
+            bytes += len;
+        }
+        if (ce.unlogged_pages_ != 0) {
+            entries.push_back(&ce);
+        }
+    }
+    if (records.empty()) {
+        return 0;
+    }
+    uint64_t lsn = wal_->Append(records);
+    if (lsn == 0) {
+        counters_.Add(FileCacheCounters::kIoErrors);
+        return 0;
+    }
+    counters_.Add(FileCacheCounters::kWalBytes, bytes);
+    for (auto ce : entries) {
+        ce->logged_pages_ |= ce->unlogged_pages_;
+        ce->unlogged_pages_ = 0;
+        ce->wal_lsn_ = lsn;
+    }
+    if (lsn >= next_checkpoint_) {
+        checkpoint_wal();
+    }
+    return lsn;
+}
+
+/*checkpoint_wal
+ * Writes every unpinned dirty entry in place and syncs it together with
+ * the files evicted since the last checkpoint, then empties the log. If a
+ * pinned entry still has logged pages the log is kept and the next try
+ * is another wal_checkpoint_bytes away. m_ held.
+ */
+void
+FileCacheImpl::checkpoint_wal()
+{
+    std::vector<std::map<std::string, CacheEntry>::iterator> entries;
+    for (auto fitr = file_cache_.begin(); fitr != file_cache_.end(); ++fitr) {
+        entries.push_back(fitr);
+    }
+    bool ok = wal_->Sync(UINT64_MAX) && flush_entries(entries);
+    for (const auto& file : checkpoint_files_) {
+        ok = sync_file(file.first, file.second) && ok;
+        ::close(file.first);
+    }
+    checkpoint_files_.clear();
+    for (const auto& ce : file_cache_) {
+        if ((ce.second.logged_pages_ & ce.second.dirty_pages_) != 0) {
+            ok = false;
+        }
+    }
+    if (ok && wal_->Truncate()) {
+        counters_.Add(FileCacheCounters::kWalCheckpoints);
+        next_checkpoint_ = options_.wal_checkpoint_bytes;
+    } else {
+        next_checkpoint_ = wal_->Size() + options_.wal_checkpoint_bytes;
+    }
+}
+
+/*background_loop
+ * Runs the periodic work that is enabled: group commit every
+ * group_commit_ms, index saves every index_interval_ms and compression
+ * sweeps every compress_after_ms.
+ */
+void
+FileCacheImpl::background_loop()
+{
+    typedef std::chrono::steady_clock clock;
+    struct Task {
+        std::chrono::milliseconds interval;
+        clock::time_point next;
+        void (FileCacheImpl::*run)();
+    };
+    std::vector<Task> tasks;
+    auto add_task = [&](int interval_ms, void (FileCacheImpl::*run)()) {
+        Task task;
+        task.interval = std::chrono::milliseconds(interval_ms);
+        task.next = clock::now() + task.interval;
+        task.run = run;
+        tasks.push_back(task);
+    };
+    if (options_.durability == kDurabilityGroupCommit) {
+        add_task(options_.group_commit_ms, &FileCacheImpl::group_commit);
+    }
+    if (!options_.index_path.empty() && options_.index_interval_ms > 0) {
+        add_task(options_.index_interval_ms, &FileCacheImpl::save_index);
+    }
+    if (options_.compress) {
+        add_task(options_.compress_after_ms, &FileCacheImpl::compress_sweep);
+    }
+    std::unique_lock<std::mutex> lock(background_m_);
+    while (!stopping_ && !tasks.empty()) {
+        auto wake = tasks[0].next;
+        for (const auto& task : tasks) {
+            wake = std::min(wake, task.next);
+        }
+        background_cv_.wait_until(lock, wake);
+        if (stopping_) {
+            break;
+        }
+        lock.unlock();
+        auto now = clock::now();
+        for (auto& task : tasks) {
+            if (now >= task.next) {
+                (this->*task.run)();
+                task.next = now + task.interval;
+            }
+        }
+        lock.lock();
+    }
+}
+
+/*load_index
+ * Reads options_.index_path into prefetch_list_. A missing or damaged
+ * index just means a cold start.
+ */
+void
+FileCacheImpl::load_index()
+{
+    std::ifstream in(options_.index_path.c_str());
+    std::string line;
+    if (!std::getline(in, line) || line != FILE_CACHE_INDEX_MAGIC) {
+        return;
+    }
+    while ((int)prefetch_list_.size() < max_cache_entries_ &&
+           std::getline(in, line)) {
+        //"accesses age name", the name may contain spaces
+        std::istringstream fields(line);
+        uint64_t accesses, age;
+        std::string name;
+        if (!(fields >> accesses >> age) || fields.get() != ' ' ||
+            !std::getline(fields, name) || name.empty()) {
+            break;
+        }
+        prefetch_list_.push_back(std::make_pair(name, accesses));
+    }
+}
+
+/*save_index
+ * Writes the resident file names, hottest first: most accessed, then most
+ * recently accessed. Goes through a temporary file and rename() so a crash
+ * leaves the old index or the new one.
+ */
+void
+FileCacheImpl::save_index()
+{
+    struct IndexEntry {
+        uint64_t accesses;
+        uint64_t age;
+        std::string name;
+        bool operator<(const IndexEntry& other) const
+        {
+            return accesses != other.accesses ? accesses > other.accesses :
+                                                age < other.age;
+        }
+    };
+    std::vector<IndexEntry> entries;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        for (const auto& ce : file_cache_) {
+            if (ce.first.find('\n') != std::string::npos) {
+                continue;
+            }
+            IndexEntry entry;
+            entry.accesses = ce.second.accesses_;
+            entry.age = access_clock_ - ce.second.last_access_;
+            entry.name = ce.first;
+            entries.push_back(entry);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::ostringstream out;
+    out << FILE_CACHE_INDEX_MAGIC << "\n";
+    for (const auto& entry : entries) {
+        out << entry.accesses << " " << entry.age << " " << entry.name << "\n";
+    }
+    std::string data = out.str();
+    std::string tmp_path = options_.index_path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool saved = (fd >= 0);
+    size_t offset = 0;
+    while (saved && offset < data.size()) {
+        ssize_t nbytes = ::write(fd, data.data() + offset,
+                                 data.size() - offset);
+        if (nbytes < 0 && errno != EINTR) {
+            saved = false;
+        } else if (nbytes > 0) {
+            offset += nbytes;
+        }
+    }
+    saved = saved && ::fdatasync(fd) == 0 &&
+            ::rename(tmp_path.c_str(), options_.index_path.c_str()) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!saved) {
+        std::ostringstream err_str;
+        err_str << "Error saving index " << options_.index_path
+                << " : " << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        counters_.Add(FileCacheCounters::kIoErrors);
+    }
+}
+
+/*prefetch_loop
+ * Loads prefetch_list_ entries into free cache slots until the list runs
+ * out or the cache is full. Files are read without m_, so several threads
+ * overlap their I/O; a file written back meanwhile is read again later
+ * on demand rather than inserted from a possibly stale read.
+ */
+void
+FileCacheImpl::prefetch_loop()
+{
+    size_t i;
+    while (!prefetch_stop_ &&
+           (i = prefetch_next_.fetch_add(1)) < prefetch_list_.size()) {
+        const std::string& file_name = prefetch_list_[i].first;
+        uint64_t seq;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if ((int)file_cache_.size() >= max_cache_entries_) {
+                return;
+            }
+            if (file_cache_.count(file_name) || demoting_.count(file_name)) {
+                continue;
+            }
+            seq = write_back_seq_.load(std::memory_order_relaxed);
+        }
+        FileCacheLatencyTimer timer(fill_latency_);
+        std::shared_ptr<char> buf;
+        size_t file_bytes;
+        int fd = load_file(file_name, false, true, buf, file_bytes);
+        if (fd < 0) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(m_);
+        if (seq != write_back_seq_.load(std::memory_order_relaxed) ||
+            file_cache_.count(file_name) ||
+            (int)file_cache_.size() >= max_cache_entries_) {
+            ::close(fd);
+            release_buffer(buf);
+            continue;
+        }
+        CacheEntry& ce = insert_cache_entry(file_name, buf, fd, file_bytes, 0);
+        //Keep the history so the next index ranks it the same way
+        ce.accesses_ = prefetch_list_[i].second;
+        ce.last_access_ = access_clock_;
+        counters_.Add(FileCacheCounters::kPrefetches);
+    }
+}
+
+bool
+FileCacheImpl::Flush(const std::vector<std::string>& file_vec)
+{
+    if (tracer_) {
+        tracer_->Record(kTraceFlush, file_vec);
+    }
+    if (wal_) {
+        //Unpinned entries are all in the log already
+        return wal_->Sync(UINT64_MAX);
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    std::vector<std::map<std::string, CacheEntry>::iterator> entries;
+    for (const auto& file_name : file_vec) {
+        auto fitr = file_cache_.find(file_name);
+        if (fitr != file_cache_.end()) {
+            entries.push_back(fitr);
+        }
+    }
+    return flush_entries(entries);
+}
+
+bool
+FileCacheImpl::FlushAll()
+{
+    if (tracer_) {
+        tracer_->Record(kTraceFlush, std::vector<std::string>());
+    }
+    if (wal_) {
+        return wal_->Sync(UINT64_MAX);
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    std::vector<std::map<std::string, CacheEntry>::iterator> entries;
+    for (auto fitr = file_cache_.begin(); fitr != file_cache_.end(); ++fitr) {
+        entries.push_back(fitr);
+    }
+    return flush_entries(entries);
+}
+
+/*flush_entries
+ * Input: candidate entries, m_ held by the caller
+ * Output: true if every dirty unpinned entry among them was written and
+ *         synced. Writers only touch their own entries, the shared state
+ *         they update (counters, gauges, histograms, write_back_seq_) is
+ *         atomic.
+ */
+bool
+FileCacheImpl::flush_entries(const std::vector<std::map<std::string,
+                             CacheEntry>::iterator>& entries)
+{
+    struct FlushItem {
+        dev_t dev;
+        ino_t ino;
+        uint64_t physical;
+        std::map<std::string, CacheEntry>::iterator fitr;
+        bool operator<(const FlushItem& other) const
+        {
+            return std::tie(dev, physical, ino) <
+                   std::tie(other.dev, other.physical, other.ino);
+        }
+    };
+    std::vector<FlushItem> items;
+    std::set<std::string> dirs;
+    for (auto fitr : entries) {
+        CacheEntry& ce = fitr->second;
+        if (ce.write_pins_ != 0 || !prepare_write_back(ce)) {
+            continue;
+        }
+        FlushItem item;
+        struct stat st;
+        if (::fstat(ce.fd_, &st) == 0) {
+            item.dev = st.st_dev;
+            item.ino = st.st_ino;
+        } else {
+            item.dev = 0;
+            item.ino = 0;
+        }
+        item.physical = physical_offset(ce.fd_);
+        item.fitr = fitr;
+        items.push_back(item);
+        if (ce.new_file_) {
+            dirs.insert(parent_dir(fitr->first));
+            ce.new_file_ = false;
+        }
+    }
+    if (items.empty()) {
+        return true;
+    }
+    //Without extent information this falls back to inode order, which
+    //most file systems allocate roughly in creation order
+    std::sort(items.begin(), items.end());
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto writer = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < items.size()) {
+            auto fitr = items[i].fitr;
+            if (!write_back_cache_entry(fitr->first, fitr->second)) {
+                ok = false;
+                continue;
+            }
+            if (!sync_file(fitr->second.fd_, fitr->first)) {
+                ok = false;
+            }
+        }
+    };
+    size_t num_writers = std::min(items.size(),
+                                  (size_t)std::max(1, options_.flush_threads));
+    std::vector<std::thread> writers;
+    for (size_t i = 1; i < num_writers; i++) {
+        writers.push_back(std::thread(writer));
+    }
+    writer();
+    for (auto& w : writers) {
+        w.join();
+    }
+
+    //Make new directory entries durable, once per directory
+    for (const auto& dir : dirs) {
+        if (!sync_dir(dir)) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+FileCacheStats
+FileCacheImpl::GetStats() const
+{
+    FileCacheStats stats;
+    stats.hits = counters_.Sum(FileCacheCounters::kHits);
+    stats.misses = counters_.Sum(FileCacheCounters::kMisses);
+    stats.clean_evictions = counters_.Sum(FileCacheCounters::kCleanEvictions);
+    stats.dirty_evictions = counters_.Sum(FileCacheCounters::kDirtyEvictions);
+    stats.write_backs = counters_.Sum(FileCacheCounters::kWriteBacks);
+    stats.write_back_bytes = counters_.Sum(FileCacheCounters::kWriteBackBytes);
+    stats.skipped_write_backs =
+        counters_.Sum(FileCacheCounters::kSkippedWriteBacks);
+    stats.skipped_write_back_bytes =
+        counters_.Sum(FileCacheCounters::kSkippedWriteBackBytes);
+    stats.syncs = counters_.Sum(FileCacheCounters::kSyncs);
+    stats.wal_bytes = counters_.Sum(FileCacheCounters::kWalBytes);
+    stats.wal_checkpoints = counters_.Sum(FileCacheCounters::kWalCheckpoints);
+    stats.wal_recovered_batches =
+        counters_.Sum(FileCacheCounters::kWalRecoveredBatches);
+    stats.prefetches = counters_.Sum(FileCacheCounters::kPrefetches);
+    stats.l2_hits = counters_.Sum(FileCacheCounters::kL2Hits);
+    stats.l2_admissions = counters_.Sum(FileCacheCounters::kL2Admissions);
+    stats.l2_rejections = counters_.Sum(FileCacheCounters::kL2Rejections);
+    stats.compressions = counters_.Sum(FileCacheCounters::kCompressions);
+    stats.compressed_hits = counters_.Sum(FileCacheCounters::kCompressedHits);
+    stats.compress_in_bytes =
+        counters_.Sum(FileCacheCounters::kCompressInBytes);
+    stats.compress_out_bytes =
+        counters_.Sum(FileCacheCounters::kCompressOutBytes);
+    stats.zero_page_loads = counters_.Sum(FileCacheCounters::kZeroPageLoads);
+    stats.copy_on_writes = counters_.Sum(FileCacheCounters::kCopyOnWrites);
+    stats.dedup_hits = counters_.Sum(FileCacheCounters::kDedupHits);
+    stats.snapshot_publishes =
+        counters_.Sum(FileCacheCounters::kSnapshotPublishes);
+    stats.txn_commits = counters_.Sum(FileCacheCounters::kTxnCommits);
+    stats.txn_aborts = counters_.Sum(FileCacheCounters::kTxnAborts);
+    stats.range_block_loads =
+        counters_.Sum(FileCacheCounters::kRangeBlockLoads);
+    stats.range_block_evictions =
+        counters_.Sum(FileCacheCounters::kRangeBlockEvictions);
+    stats.front_cache_hits = counters_.Sum(FileCacheCounters::kFrontCacheHits);
+    stats.io_errors = counters_.Sum(FileCacheCounters::kIoErrors);
+    stats.wait_ns = counters_.Sum(FileCacheCounters::kWaitNs);
+    stats.pinned_entries = pinned_entries_.load(std::memory_order_relaxed);
+    stats.dirty_entries = dirty_entries_.load(std::memory_order_relaxed);
+    stats.resident_entries = resident_entries_.load(std::memory_order_relaxed);
+    stats.compressed_entries =
+        compressed_entries_.load(std::memory_order_relaxed);
+    stats.compressed_bytes = compressed_bytes_gauge_.load(
+            std::memory_order_relaxed);
+    stats.dedup_saved_bytes =
+        dedup_saved_bytes_.load(std::memory_order_relaxed);
+    stats.snapshot_versions =
+        snapshot_versions_.load(std::memory_order_relaxed);
+    stats.range_bytes = ranges_->ResidentBytes();
+    if (lazy_) {
+        stats.lazy_faults = lazy_->Faults();
+        stats.lazy_pages = lazy_->Pages();
+        stats.io_errors += lazy_->Errors();
+    }
+    if (numa_pool_) {
+        for (int node = 0; node < FileCacheNumaPool::Nodes(); node++) {
+            stats.numa_buffers.push_back(numa_pool_->InUse(node));
+            stats.numa_allocations.push_back(numa_pool_->Allocations(node));
+        }
+    }
+    return stats;
+}
+
+int
+FileCacheImpl::NumaNode(const std::string& file_name) const
+{
+    switch (options_.numa_placement) {
+    case kNumaLocal:
+        return FileCacheNumaPool::CurrentNode();
+    case kNumaShard:
+        return FileCacheHash64(file_name.data(), file_name.size()) %
+               FileCacheNumaPool::Nodes();
+    default:
+        return -1;
+    }
+}
+
+FileCacheLatency
+FileCacheImpl::GetLatency(bool reset)
+{
+    FileCacheLatency latency;
+    latency.pin = pin_latency_.Snapshot(reset);
+    latency.fill = fill_latency_.Snapshot(reset);
+    latency.write_back = write_back_latency_.Snapshot(reset);
+    latency.unpin = unpin_latency_.Snapshot(reset);
+    latency.decompress = decompress_latency_.Snapshot(reset);
+    return latency;
+}
+
+std::string
+FileCacheImpl::ExportPrometheus(bool reset)
+{
+    return FileCachePrometheusText(GetStats(), GetLatency(reset));
 }
@@ -3,46 +3,494 @@
 #define _FILE_CACHE_IMPL_H_
 
 
+#include<atomic>
 #include<memory>
 #include<mutex>
 #include<map>
 #include <set>
 #include<condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include"file_cache.h"
+#include"file_cache_stats.h"
+#include"file_cache_l2.h"
+#include"file_cache_lazy.h"
+#include"file_cache_numa.h"
+#include"file_cache_range.h"
+#include"file_cache_trace.h"
+#include"file_cache_wal.h"
 
 //Constant file size 10 * 1024 bytes
 #define FILE_SIZE 10240
 
+//Granularity of dirty tracking, one bit per page in CacheEntry::dirty_pages_
+#define DIRTY_PAGE_SIZE 4096
+#define DIRTY_PAGES ((FILE_SIZE + DIRTY_PAGE_SIZE - 1) / DIRTY_PAGE_SIZE)
+static_assert(DIRTY_PAGES <= 64, "dirty page bitmap is a uint64_t");
+
+//First line of a FileCacheOptions::index_path file, followed by one
+//"accesses age name" line per file, hottest first
+#define FILE_CACHE_INDEX_MAGIC "FCINDEX1"
+
+
+/* How write-back decides whether dirty pages really changed */
+enum FileCacheCleanCheck {
+    kCleanCheckNone,     //write every dirty page
+    kCleanCheckShadow,   //compare with a copy taken at load, 2x memory
+    kCleanCheckHash      //compare per-page hashes taken at load
+};
+
+/* What FileCacheImpl does to make written-back data durable */
+enum FileCacheDurability {
+    kDurabilityNone,         //leave it to the kernel's writeback
+    kDurabilitySync,         //fdatasync() after every write-back
+    kDurabilityGroupCommit,  //one batch of syncs every group_commit_ms
+    kDurabilityAsync         //sync_file_range() starts writeback, no wait
+};
+
+/* Which NUMA node FileCacheImpl puts a file's buffer on */
+enum FileCacheNumaPlacement {
+    kNumaNone,    //wherever the allocator and first touch put it
+    kNumaLocal,   //node of the thread that loads the file
+    kNumaShard    //FileCacheImpl::NumaNode(), a hash of the file name
+};
+
+/* Optional FileCacheImpl features, all off by default. */
+struct FileCacheOptions {
+    FileCacheOptions() : write_protect(false),
+                         clean_check(kCleanCheckNone),
+                         flush_threads(4),
+                         durability(kDurabilityNone),
+                         group_commit_ms(10),
+                         wal_checkpoint_bytes(64 << 20),
+                         index_interval_ms(0),
+                         prefetch_threads(4),
+                         l2_bytes((uint64_t)1 << 30),
+                         l2_write_budget(0),
+                         compress(false),
+                         compress_after_ms(1000),
+                         compress_bytes(64 << 20),
+                         dedup(false),
+                         snapshot_reads(false),
+                         range_block_size(64 << 10),
+                         range_cache_bytes(256 << 20),
+                         lazy_load(false),
+                         lazy_readahead_pages(1),
+                         numa_placement(kNumaNone),
+                         front_cache(false)
+    {}
+
+    // Record every API call into this file for file_cache_replay and
+    // file_cache_sim. Empty means no tracing.
+    std::string trace_path;
+
+    // Detect writes through page protection instead of trusting
+    // MutableFileData(): buffers are mapped read-only and only pages that
+    // are actually stored to become dirty, so entries handed out mutable
+    // but never written are evicted clean. Uses a process wide SIGSEGV
+    // handler, see file_cache_write_protect.h.
+    bool write_protect;
+
+    // Skip write-back of dirty pages whose contents are the same as when
+    // they were loaded, e.g. callers that asked for MutableFileData() and
+    // never wrote or wrote back the same bytes. The hash variant can miss
+    // a change with probability 2^-64 per page.
+    FileCacheCleanCheck clean_check;
+
+    // Most writers Flush() and FlushAll() run at once, at least 1.
+    int flush_threads;
+
+    // Durability of evictions and of the write-back at destruction.
+    // Flush() always syncs. With kDurabilityGroupCommit a background
+    // thread syncs the files written back in the last group_commit_ms,
+    // so data reaches storage at most that much later, at the cost of one
+    // dup()ed descriptor per pending file. kDurabilityAsync only narrows
+    // the window: sync_file_range() neither waits nor flushes metadata or
+    // the device cache.
+    FileCacheDurability durability;
+    int group_commit_ms;
+
+    // Write-ahead log, empty for none. UnpinFiles() appends the pages the
+    // caller dirtied in all of 'file_vec' as one batch, and no page is
+    // written in place before its batch is on storage, so a crash leaves
+    // either all or none of a batch. The constructor replays the log
+    // left by a crash. Durability applies to the log: kDurabilitySync
+    // syncs it before UnpinFiles() returns, group commit in the
+    // background, and Flush() just syncs it. When the log passes
+    // wal_checkpoint_bytes the dirty entries are written in place and it
+    // starts over; entries still pinned hold that back.
+    std::string wal_path;
+    uint64_t wal_checkpoint_bytes;
+
+    // Warm restart. If set, the names of the resident files with their
+    // access counts and recency are saved here by the destructor, and
+    // every index_interval_ms if that is non-zero. The constructor reads
+    // it back and prefetch_threads background threads load the hottest
+    // files, as many as fit, unpinned. Prefetching never evicts and never
+    // creates files that have gone away.
+    std::string index_path;
+    int index_interval_ms;
+    int prefetch_threads;
+
+    // Second tier on local flash, see file_cache_l2.h. Empty path for
+    // none. Evicted entries that are clean (after their write-back, if
+    // they were dirty) are offered to it, and a miss checks it before
+    // reading the file. The file itself is still opened on an L2 hit,
+    // for later write-backs. l2_write_budget caps demotion writes in
+    // bytes per second, 0 for no cap.
+    std::string l2_path;
+    uint64_t l2_bytes;
+    uint64_t l2_write_budget;
+
+    // Compress cold entries. Every compress_after_ms, clean unpinned
+    // entries that were not pinned since the last round are LZ compressed
+    // (file_cache_lz.h) into a pool outside the max_cache_entries limit,
+    // and their slots are freed. A miss is served from the pool before
+    // L2 and the file. The pool holds up to compress_bytes of compressed
+    // data and drops its oldest entries past that.
+    bool compress;
+    int compress_after_ms;
+    uint64_t compress_bytes;
+
+    // Share one buffer between entries whose files have identical
+    // contents. Every loaded buffer is hashed and looked up in a table of
+    // the buffers in use; a match that compares equal byte for byte is
+    // shared. Shared buffers are read-only until MutableFileData() or
+    // MutableFileRange() gives the entry a copy of its own. Costs a hash
+    // of every load and a copy on the first mutation of a shared buffer.
+    bool dedup;
+
+    // Versioned buffers, so that read pins never see a write in progress.
+    // The first MutableFileData() or MutableFileRange() of a write pin
+    // hands out a private draft copy, and when the entry's last write pin
+    // is dropped the draft atomically replaces the version readers get.
+    // PinFilesForRead() returns the version current at the time, which
+    // stays valid and unchanged until the thread's read pins are all
+    // dropped. Replaced versions are freed once every thread that read
+    // pinned before the replacement has dropped its read pins (epoch based
+    // reclamation). Threads holding write pins see the drafts through
+    // FileData(), as before, other threads the published version; with
+    // write_protect set, drafts are still marked dirty by the calls that
+    // hand them out rather than by page faults.
+    bool snapshot_reads;
+
+    // Block size and memory budget of PinRange(), see
+    // file_cache_range.h. The block size is rounded up to 4KB.
+    size_t range_block_size;
+    uint64_t range_cache_bytes;
+
+    // Load files on first touch instead of in PinFiles(). A miss only
+    // maps address space for the buffer and registers it with
+    // userfaultfd (file_cache_lazy.h); each page is read from the file,
+    // together with lazy_readahead_pages pages on either side, when it is
+    // first accessed. Cannot be combined with write_protect, which also
+    // owns the buffers' page faults, or dedup, which needs the contents
+    // at load; the constructor throws std::runtime_error for either, or
+    // if userfaultfd is not available. clean_check, compression and L2
+    // demotion read whole buffers and so fault in the rest of the file.
+    bool lazy_load;
+    int lazy_readahead_pages;
+
+    // NUMA placement of buffers, see file_cache_numa.h. Buffers come from
+    // per-node pools whose pages are bound to their node; with
+    // write_protect or lazy_load each buffer's own mapping is bound
+    // instead. Copies made for writing stay on the node of the entry.
+    // kNumaShard is for callers that bind threads to nodes and give each
+    // node the files NumaNode() assigns to it.
+    FileCacheNumaPlacement numa_placement;
+
+    // Serve repeated FileData() calls from a small direct-mapped cache
+    // per thread, without taking the cache lock. Slots remember the
+    // buffer FileData() returned and the cache generation at the time;
+    // evictions and anything else that changes which buffer FileData()
+    // would return bump the generation, so older slots miss. As with the
+    // locked path, the file has to be pinned for the result to be used.
+    bool front_cache;
+};
 
 class FileCacheImpl : public FileCache {
 public:
-    FileCacheImpl(int max_cache_entries) : FileCache(max_cache_entries)
-    {}
+    FileCacheImpl(int max_cache_entries,
+                  const FileCacheOptions& options = FileCacheOptions());
+    ~FileCacheImpl();
+
+    // PinFiles() and UnpinFiles() take and drop write pins, same as
+    // PinFilesForWrite(). Only entries that hold a write pin can be handed
+    // out by MutableFileData() and MutableFileRange(), which return
+    // nullptr otherwise.
     void PinFiles(const std::vector<std::string>& file_vec);
     void UnpinFiles(const std::vector<std::string>& file_vec);
+    void PinFilesForWrite(const std::vector<std::string>& file_vec);
+
+    // Read pins. Any number of threads may hold them, alongside write pins.
+    // Returns the buffers of 'file_vec' in the same order (nullptr for a
+    // file that could not be loaded). They stay valid until the pins are
+    // dropped with UnpinFilesForRead(), and reading them needs no call
+    // into the cache and so no lock, unlike FileData(). Entries pinned
+    // only for reading cannot become dirty, so Flush() and WAL checkpoints
+    // need not wait for them and dropping a read pin logs nothing.
+    std::vector<const char *>
+    PinFilesForRead(const std::vector<std::string>& file_vec);
+    void UnpinFilesForRead(const std::vector<std::string>& file_vec);
+
     const char *FileData(const std::string& file_name);
     char *MutableFileData(const std::string& file_name);
+
+    // Write access to bytes [offset, offset + len) of a pinned file. Like
+    // MutableFileData() but only the pages covering the range are marked
+    // dirty, so write-back skips the rest of the file. Returns a pointer to
+    // the first byte of the range, or nullptr if the file isn't cached or
+    // the range doesn't fit in FILE_SIZE.
+    char *MutableFileRange(const std::string& file_name, size_t offset,
+                           size_t len);
+
+    // Writes back the dirty entries among 'file_vec' (FlushAll(): all of
+    // them) and makes them durable. Entries are ordered by device, inode
+    // and on-disk position and written by up to options.flush_threads
+    // threads, each file is fdatasync()ed and the parent directories of
+    // newly created files are fsync()ed once each for the batch. Entries
+    // with write pins are skipped, their owner may still be writing.
+    // Holds the cache lock throughout. Returns false if any write or sync
+    // failed.
+    bool Flush(const std::vector<std::string>& file_vec);
+    bool FlushAll();
+
+    // Multi-file transactions, which need FileCacheOptions::wal_path
+    // (std::runtime_error otherwise). BeginTxn() waits until none of
+    // 'file_vec' is in another transaction, write pins them all and
+    // returns the transaction id. Until Commit() or Abort() the files'
+    // MutableFileData() and MutableFileRange() hand out private drafts.
+    // Commit() applies the drafts, appends all their pages to the log as
+    // one batch and syncs it once, then drops the pins: after a crash the
+    // constructor replays either all of the transaction or none of it.
+    // Returns false if the log could not be written or synced. Abort()
+    // throws the drafts away and drops the pins. Other writers of the
+    // same files write to the same drafts.
+    uint64_t BeginTxn(const std::vector<std::string>& file_vec);
+    bool Commit(uint64_t txn);
+    void Abort(uint64_t txn);
+
+    // Range access to files of any size, for reading parts of files too
+    // large to cache whole. PinRange() reads only the blocks covering
+    // [offset, offset + len) that are not resident yet and pins them;
+    // returns false if the file can't be opened or read. FileRange()
+    // returns a pointer to byte 'offset' of a pinned range and trims
+    // 'len' to the bytes contiguous there, which end at a block boundary,
+    // so longer ranges are read a block at a time. UnpinRange() drops the
+    // pins of a PinRange() with the same arguments. Ranges are read-only
+    // and kept apart from the FILE_SIZE entries: a file is accessed either
+    // way, not both.
+    bool PinRange(const std::string& file_name, uint64_t offset, size_t len);
+    void UnpinRange(const std::string& file_name, uint64_t offset,
+                    size_t len);
+    const char *FileRange(const std::string& file_name, uint64_t offset,
+                          size_t& len);
+
+    // Node the buffer of 'file_name' goes on when it is loaded by the
+    // calling thread, -1 with kNumaNone.
+    int NumaNode(const std::string& file_name) const;
+
+    // Snapshot of the cache counters and gauges. Never takes m_, so it is
+    // safe to call from a monitoring thread while PinFiles() is blocked.
+    FileCacheStats GetStats() const;
+
+    // Latency histograms of the PinFiles, fill, write-back and UnpinFiles
+    // paths. With 'reset' the histograms start over after the snapshot.
+    FileCacheLatency GetLatency(bool reset = false);
+
+    // GetStats() and GetLatency() in Prometheus text exposition format.
+    std::string ExportPrometheus(bool reset = false);
 private:
     struct CacheEntry {
         CacheEntry(std::shared_ptr<char> file_buf,
                    uint32_t pin_count,
                    int fd) : file_buf_(file_buf),
                              pin_count_(pin_count), 
-                             dirty_(false),
-                             fd_(fd)
+                             write_pins_(0),
+                             dirty_pages_(0),
+                             unlogged_pages_(0),
+                             logged_pages_(0),
+                             wal_lsn_(0),
+                             accesses_(0),
+                             last_access_(0),
+                             incompressible_(false),
+                             fd_(fd),
+                             numa_node_(-1),
+                             new_file_(false),
+                             short_file_(false),
+                             shared_buf_(false),
+                             write_protected_(false),
+                             fault_pages_(0),
+                             draft_pages_(0),
+                             in_txn_(false)
         {}
         ~CacheEntry();
+        //Either private to the entry or, until the first MutableFileData()
+        //or MutableFileRange() call, the read-only shared zero page or a
+        //buffer in the dedup table (shared_buf_ set)
         std::shared_ptr<char> file_buf_;
+        //All pins, and those taken for writing
         uint32_t pin_count_;
-        bool dirty_;
+        uint32_t write_pins_;
+        //Bit i set means bytes [i, i + 1) * DIRTY_PAGE_SIZE need write-back
+        uint64_t dirty_pages_;
+        bool dirty() const { return dirty_pages_ != 0; }
+        //With a WAL: dirty pages not yet logged, pages logged but not yet
+        //written in place, and the batch that has to be synced first
+        uint64_t unlogged_pages_;
+        uint64_t logged_pages_;
+        uint64_t wal_lsn_;
+        //PinFiles() calls that asked for it, and access_clock_ at the last
+        uint64_t accesses_;
+        uint64_t last_access_;
+        //Compression didn't pay off, don't try again
+        bool incompressible_;
         int fd_;
+        //Node its buffers are allocated on, -1 for no placement
+        int numa_node_;
+        //Empty when opened, likely created by us, so its directory entry
+        //needs a sync too
+        bool new_file_;
+        //Shorter than FILE_SIZE on storage, extended on first write-back
+        bool short_file_;
+        bool shared_buf_;
+        //Buffer registered with FileCacheWriteProtect, whose fault handler
+        //sets fault_pages_ bits on the first store to each page
+        bool write_protected_;
+        std::atomic<uint64_t> fault_pages_;
+        //Shared buffer replaced by copy_on_write() while other pins may
+        //still point into it, kept until the entry goes away
+        std::shared_ptr<char> retired_buf_;
+        //FileCacheOptions::snapshot_reads: the write session's private
+        //copy and the pages it was handed out for
+        std::shared_ptr<char> draft_buf_;
+        uint64_t draft_pages_;
+        //Threads holding its write pins and how many, the only ones
+        //FileData() hands the draft to
+        std::map<std::thread::id, uint32_t> writers_;
+        //Part of a transaction, whose writes go to the draft too
+        bool in_txn_;
+        //Contents on storage, for FileCacheOptions::clean_check
+        std::shared_ptr<char> shadow_buf_;
+        uint64_t page_hash_[DIRTY_PAGES];
     };
     std::map<std::string, CacheEntry> file_cache_;
     std::mutex m_;  
     std::condition_variable cv_;
+    const FileCacheOptions options_;
+    std::unique_ptr<FileCacheTracer> tracer_;
+
+    //Statistics, updated with relaxed atomics so GetStats() can skip m_
+    FileCacheCounters counters_;
+    std::atomic<int64_t> pinned_entries_;
+    std::atomic<int64_t> dirty_entries_;
+    std::atomic<int64_t> resident_entries_;
+    FileCacheHistogram pin_latency_;
+    FileCacheHistogram fill_latency_;
+    FileCacheHistogram write_back_latency_;
+    FileCacheHistogram unpin_latency_;
+    FileCacheHistogram decompress_latency_;
+
+    //Background thread for kDurabilityGroupCommit. background_m_ also
+    //guards the files waiting for the next commit, as dup()ed fds.
+    std::mutex background_m_;
+    std::condition_variable background_cv_;
+    bool stopping_;
+    std::vector<std::pair<int, std::string> > commit_files_;
+    std::set<std::string> commit_dirs_;
+    std::thread background_;
+
+    std::unique_ptr<FileCacheWal> wal_;
+    std::unique_ptr<FileCacheL2> l2_;
+    //Copies of evicted entries, written to l2_ after m_ is dropped
+    typedef std::vector<std::pair<std::string, std::shared_ptr<char> > >
+            Demotions;
+    //Under m_: files with demotions in flight and how many, and those of
+    //them loaded again meanwhile, whose L2 copy may already be stale
+    std::map<std::string, int> demoting_;
+    std::set<std::string> demote_stale_;
+    //Files written in place since the last checkpoint, as dup()ed fds
+    std::vector<std::pair<int, std::string> > checkpoint_files_;
+    uint64_t next_checkpoint_;
+
+    //Logical time for recency, ticks once per pinned entry, under m_
+    uint64_t access_clock_;
+    //Bumped on every write-back so prefetchers can tell their read of
+    //a file may predate its latest contents. Atomic since flush writers
+    //bump it in parallel.
+    std::atomic<uint64_t> write_back_seq_;
+    //Index entries to prefetch, hottest first, as name and accesses
+    std::vector<std::pair<std::string, uint64_t> > prefetch_list_;
+    std::atomic<size_t> prefetch_next_;
+    std::atomic<bool> prefetch_stop_;
+    std::vector<std::thread> prefetchers_;
+
+    //Compressed pool, guarded by compressed_m_ which nests inside m_.
+    //compressed_order_ lists (name, seq) in insertion order and may hold
+    //stale pairs for names taken or recompressed since.
+    struct CompressedEntry {
+        CompressedEntry() : seq(0) {}
+        std::string data;
+        uint64_t seq;
+    };
+    uint64_t compress_clock_;   //access_clock_ at the last sweep, under m_
+    std::mutex compressed_m_;
+    std::map<std::string, CompressedEntry> compressed_;
+    std::deque<std::pair<std::string, uint64_t> > compressed_order_;
+    uint64_t compressed_seq_;
+    uint64_t compressed_bytes_;
+    std::atomic<int64_t> compressed_entries_;
+    std::atomic<int64_t> compressed_bytes_gauge_;
+
+    //Buffers in use by hash of their contents, for FileCacheOptions::dedup.
+    //Guarded by dedup_m_, which nests inside m_. Every reference to a
+    //buffer in the table is taken or dropped under dedup_m_, so its
+    //use_count() is exact there: the number of entries sharing it.
+    std::mutex dedup_m_;
+    std::unordered_map<uint64_t, std::weak_ptr<char> > dedup_;
+    std::atomic<int64_t> dedup_saved_bytes_;
+
+    //FileCacheOptions::snapshot_reads, under m_. snapshot_epoch_ ticks on
+    //every publish. Each thread holding read pins has a slot with the
+    //epoch of its first one and how many it holds. Replaced versions wait
+    //in retired_versions_, tagged with the epoch they were replaced in.
+    struct ReaderSlot {
+        ReaderSlot() : epoch(0), pins(0) {}
+        uint64_t epoch;
+        size_t pins;
+    };
+    uint64_t snapshot_epoch_;
+    std::map<std::thread::id, ReaderSlot> readers_;
+    std::deque<std::pair<uint64_t, std::shared_ptr<char> > > retired_versions_;
+    std::atomic<int64_t> snapshot_versions_;
+
+    //Open transactions by id and the files they hold, under m_
+    uint64_t next_txn_;
+    std::map<uint64_t, std::vector<std::string> > txns_;
+    std::set<std::string> txn_files_;
+
+    //PinRange() blocks, with a lock of their own
+    std::unique_ptr<FileCacheRangeTable> ranges_;
+
+    //FileCacheOptions::lazy_load, shared with the buffers it mapped
+    std::shared_ptr<FileCacheLazy> lazy_;
+    //FileCacheOptions::numa_placement, likewise
+    std::shared_ptr<FileCacheNumaPool> numa_pool_;
+
+    //FileCacheOptions::front_cache. Front cache slots are per thread and
+    //shared by all caches, cache_id_ tells whose a slot is. generation_
+    //is bumped under m_ and read without it.
+    const uint64_t cache_id_;
+    std::atomic<uint64_t> generation_;
+    void bump_generation()
+    {
+        generation_.fetch_add(1, std::memory_order_release);
+    }
     
     bool cache_entries_evictable()             
     {
@@ -53,9 +501,90 @@ private:
         }
         return false;
     }
-    uint32_t evict_cache_entries(int num_cache_entries);
-    void add_cache_entry(const std::string& file_name);
-    void fill_up_cache(std::set<std::string>& files_not_pinned);
+    void add_writer(CacheEntry& ce)
+    {
+        //Only drafts care which thread writes
+        if (options_.snapshot_reads) {
+            ce.writers_[std::this_thread::get_id()]++;
+        }
+        //FileData() now returns the draft to this thread, not what its
+        //front cache may hold
+        if (ce.draft_buf_) {
+            bump_generation();
+        }
+    }
+    void pin_cache_entry(CacheEntry& ce, bool write)
+    {
+        if (ce.pin_count_++ == 0) {
+            pinned_entries_.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (write) {
+            ce.write_pins_++;
+            add_writer(ce);
+        }
+        ce.accesses_++;
+        ce.last_access_ = ++access_clock_;
+        counters_.Add(FileCacheCounters::kHits);
+    }
+    void mark_dirty(CacheEntry& ce, uint64_t pages)
+    {
+        if (ce.dirty_pages_ == 0) {
+            dirty_entries_.fetch_add(1, std::memory_order_relaxed);
+        }
+        ce.dirty_pages_ |= pages;
+        ce.unlogged_pages_ |= pages;
+    }
+    std::shared_ptr<char> alloc_file_buf(int node);
+    uint32_t evict_cache_entries(int num_cache_entries, Demotions& demotions);
+    void collect_write_faults(CacheEntry& ce);
+    bool prepare_write_back(CacheEntry& ce);
+    void drop_unchanged_pages(CacheEntry& ce);
+    void save_clean_copy(CacheEntry& ce, uint64_t pages);
+    bool write_back_cache_entry(const std::string& file_name, CacheEntry& ce);
+    void dedup_buffer(std::shared_ptr<char>& buf);
+    bool claim_buffer(std::shared_ptr<char>& buf);
+    void release_buffer(std::shared_ptr<char>& buf);
+    bool copy_on_write(CacheEntry& ce);
+    char *draft_buffer(CacheEntry& ce, uint64_t pages);
+    void publish_draft(CacheEntry& ce);
+    void apply_draft(CacheEntry& ce);
+    std::vector<std::string> take_txn(uint64_t txn);
+    void reclaim_versions();
+    int load_file(const std::string& file_name, bool create, bool use_l2,
+                  std::shared_ptr<char>& buf, size_t& file_bytes);
+    bool lazy_file_buf(const std::string& file_name, int fd, int node,
+                       std::shared_ptr<char>& buf, size_t& file_bytes);
+    bool stored_bytes(const std::string& file_name, int fd, size_t& file_bytes);
+    CacheEntry& insert_cache_entry(const std::string& file_name,
+                                   std::shared_ptr<char> buf, int fd,
+                                   size_t file_bytes, uint32_t pin_count);
+    void add_cache_entry(const std::string& file_name, bool write);
+    void demote_cache_entry(const std::string& file_name, CacheEntry& ce,
+                            Demotions& demotions);
+    void admit_demotions(std::unique_lock<std::mutex>& lock,
+                         Demotions& demotions);
+    void compress_sweep();
+    void store_compressed(const std::string& file_name,
+                          const std::string& data);
+    bool take_compressed(const std::string& file_name, char *buf);
+    void fill_up_cache(std::set<std::string>& files_not_pinned, bool write);
+    void pin_files(std::unique_lock<std::mutex>& lock,
+                   const std::vector<std::string>& file_vec, bool write);
+    void unpin_files(const std::vector<std::string>& file_vec, bool write);
+    void drop_writer(CacheEntry& ce);
+    uint64_t drop_pins(const std::vector<std::string>& file_vec, bool write);
+    void make_durable(const std::string& file_name, CacheEntry& ce);
+    bool sync_file(int fd, const std::string& file_name);
+    bool sync_dir(const std::string& dir);
+    void group_commit();
+    uint64_t log_files(const std::vector<std::string>& file_vec);
+    void checkpoint_wal();
+    void load_index();
+    void save_index();
+    void prefetch_loop();
+    void background_loop();
+    bool flush_entries(const std::vector<std::map<std::string,
+                       CacheEntry>::iterator>& entries);
 };
 
 #endif // _FILE_CACHE_IMPL_H_
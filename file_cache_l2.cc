@@ -0,0 +1,144 @@
+#include "file_cache_l2.h"
+#include "file_cache_simd.h"
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//O_DIRECT transfers need offsets, lengths and memory aligned to this
+static const size_t kDirectAlign = 4096;
+
+FileCacheL2::FileCacheL2(const std::string& path, uint64_t capacity,
+                         size_t buf_size, uint64_t write_budget) :
+    path_(path),
+    buf_size_(buf_size),
+    slot_size_((buf_size + kDirectAlign - 1) / kDirectAlign * kDirectAlign),
+    head_(0),
+    bounce_(nullptr),
+    write_budget_(write_budget),
+    tokens_(write_budget),
+    refill_time_(std::chrono::steady_clock::now())
+{
+    num_slots_ = std::max<uint64_t>(1, capacity / slot_size_);
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0600);
+    if (fd_ < 0 && errno == EINVAL) {
+        //tmpfs and some network file systems have no O_DIRECT
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    }
+    if (fd_ < 0 || ::ftruncate(fd_, (off_t)num_slots_ * slot_size_) < 0 ||
+        posix_memalign((void **)&bounce_, kDirectAlign, slot_size_) != 0) {
+        std::ostringstream err_str;
+        err_str << "Error creating L2 cache file " << path
+                << " : " << strerror(errno);
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        throw std::runtime_error(err_str.str());
+    }
+    memset(bounce_, 0, slot_size_);
+    slot_owner_.resize(num_slots_, nullptr);
+}
+
+FileCacheL2::~FileCacheL2()
+{
+    ::close(fd_);
+    free(bounce_);
+}
+
+void
+FileCacheL2::drop_slot(uint32_t slot)
+{
+    if (slot_owner_[slot] != nullptr) {
+        //Erasing invalidates the key the owner pointer refers to
+        const std::string *owner = slot_owner_[slot];
+        slot_owner_[slot] = nullptr;
+        index_.erase(*owner);
+    }
+}
+
+FileCacheL2::Admission
+FileCacheL2::Insert(const std::string& name, const char *data)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    uint64_t name_hash = FileCacheHash64(name.data(), name.size());
+    if (doorkeeper_.erase(name_hash) == 0) {
+        if (doorkeeper_.size() >= num_slots_) {
+            doorkeeper_.clear();
+        }
+        doorkeeper_.insert(name_hash);
+        return kRejectedFirstSeen;
+    }
+    if (write_budget_ != 0) {
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(
+                now - refill_time_).count();
+        refill_time_ = now;
+        //Allow bursts of up to one second's budget
+        tokens_ = std::min((double)write_budget_,
+                           tokens_ + seconds * write_budget_);
+        if (tokens_ < slot_size_) {
+            return kRejectedBudget;
+        }
+        tokens_ -= slot_size_;
+    }
+
+    auto iitr = index_.find(name);
+    if (iitr != index_.end()) {
+        drop_slot(iitr->second.slot);
+    }
+    uint32_t slot = head_;
+    head_ = (head_ + 1) % num_slots_;
+    drop_slot(slot);
+    memcpy(bounce_, data, buf_size_);
+    ssize_t nbytes;
+    do {
+        nbytes = ::pwrite(fd_, bounce_, slot_size_, (off_t)slot * slot_size_);
+    } while (nbytes < 0 && errno == EINTR);
+    if (nbytes != (ssize_t)slot_size_) {
+        return kWriteFailed;
+    }
+    Slot entry;
+    entry.slot = slot;
+    entry.checksum = FileCacheHash64(data, buf_size_);
+    iitr = index_.insert(std::make_pair(name, entry)).first;
+    slot_owner_[slot] = &iitr->first;
+    return kAdmitted;
+}
+
+bool
+FileCacheL2::Take(const std::string& name, char *data)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    auto iitr = index_.find(name);
+    if (iitr == index_.end()) {
+        return false;
+    }
+    Slot entry = iitr->second;
+    drop_slot(entry.slot);
+    ssize_t nbytes;
+    do {
+        nbytes = ::pread(fd_, bounce_, slot_size_,
+                         (off_t)entry.slot * slot_size_);
+    } while (nbytes < 0 && errno == EINTR);
+    if (nbytes != (ssize_t)slot_size_ ||
+        FileCacheHash64(bounce_, buf_size_) != entry.checksum) {
+        return false;
+    }
+    memcpy(data, bounce_, buf_size_);
+    return true;
+}
+
+void
+FileCacheL2::Drop(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    auto iitr = index_.find(name);
+    if (iitr != index_.end()) {
+        drop_slot(iitr->second.slot);
+    }
+}
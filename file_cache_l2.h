@@ -0,0 +1,77 @@
+
+#ifndef _FILE_CACHE_L2_H_
+#define _FILE_CACHE_L2_H_
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+
+/* FileCacheL2
+ * Second cache tier for clean buffers, kept in one file on a local SSD.
+ * The file is a ring of fixed size slots written strictly in order, so the
+ * device only sees sequential writes, and the oldest slot is overwritten
+ * next (FIFO eviction). The name -> slot index lives in memory only, the
+ * tier starts out empty in every process.
+ *
+ * The tier is exclusive of the DRAM cache: Take() removes what it returns,
+ * so a copy can never go stale behind a buffer that is modified in DRAM.
+ *
+ * Admission control, to keep flash wear down:
+ *  - a buffer is only admitted the second time it is offered within
+ *    roughly one ring's worth of offers, so one-off scans don't churn
+ *    the ring
+ *  - with a write budget, offers beyond that many bytes per second are
+ *    rejected
+ *
+ * All methods are thread safe. Data moves through the slot file with
+ * O_DIRECT when the file system supports it, so the tier doesn't also
+ * fill the page cache.
+ */
+class FileCacheL2 {
+public:
+    // 'capacity' bytes of 'buf_size' byte buffers. 'write_budget' is in
+    // bytes per second, 0 for no limit. Throws std::runtime_error if the
+    // file can't be created.
+    FileCacheL2(const std::string& path, uint64_t capacity, size_t buf_size,
+                uint64_t write_budget);
+    ~FileCacheL2();
+
+    enum Admission { kAdmitted, kRejectedFirstSeen, kRejectedBudget,
+                     kWriteFailed };
+    Admission Insert(const std::string& name, const char *data);
+
+    // Copies the buffer for 'name' into 'data' and drops it from the
+    // tier. False if it isn't there or fails its checksum.
+    bool Take(const std::string& name, char *data);
+    // Forgets the buffer for 'name', if any, without reading it.
+    void Drop(const std::string& name);
+
+private:
+    struct Slot {
+        uint32_t slot;
+        uint64_t checksum;
+    };
+    std::string path_;
+    int fd_;
+    size_t buf_size_;
+    size_t slot_size_;          //buf_size_ rounded up for O_DIRECT
+    uint32_t num_slots_;
+    uint32_t head_;             //next slot to write
+    char *bounce_;              //aligned transfer buffer
+    std::mutex m_;
+    std::unordered_map<std::string, Slot> index_;
+    std::vector<const std::string *> slot_owner_;
+    //Hashes of names offered once, forgotten a ring's worth of offers later
+    std::unordered_set<uint64_t> doorkeeper_;
+    uint64_t write_budget_;
+    double tokens_;
+    std::chrono::steady_clock::time_point refill_time_;
+
+    void drop_slot(uint32_t slot);
+};
+
+#endif // _FILE_CACHE_L2_H_
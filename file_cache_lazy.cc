@@ -0,0 +1,222 @@
+#include "file_cache_lazy.h"
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+std::shared_ptr<FileCacheLazy>
+FileCacheLazy::Create(int readahead_pages)
+{
+    return std::shared_ptr<FileCacheLazy>(new FileCacheLazy(readahead_pages));
+}
+
+FileCacheLazy::FileCacheLazy(int readahead_pages) :
+    uffd_(-1),
+    stop_fd_(-1),
+    readahead_pages_(std::max(0, readahead_pages)),
+    page_size_(sysconf(_SC_PAGESIZE)),
+    bounce_(nullptr),
+    faults_(0),
+    pages_(0),
+    errors_(0)
+{
+    uffd_ = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    if (uffd_ < 0 || ::ioctl(uffd_, UFFDIO_API, &api) < 0 ||
+        (stop_fd_ = ::eventfd(0, EFD_CLOEXEC)) < 0) {
+        std::ostringstream err_str;
+        err_str << "Error creating userfaultfd : " << strerror(errno);
+        if (uffd_ >= 0) {
+            ::close(uffd_);
+        }
+        throw std::runtime_error(err_str.str());
+    }
+    void *p = ::mmap(nullptr, page_size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        ::close(uffd_);
+        ::close(stop_fd_);
+        throw std::runtime_error("Error mapping the lazy load bounce page");
+    }
+    bounce_ = (char *)p;
+    handler_ = std::thread(&FileCacheLazy::handler_loop, this);
+}
+
+FileCacheLazy::~FileCacheLazy()
+{
+    uint64_t one = 1;
+    if (::write(stop_fd_, &one, sizeof(one)) != sizeof(one)) {
+        perror("Error stopping the lazy load handler");
+    }
+    handler_.join();
+    ::close(stop_fd_);
+    ::close(uffd_);
+    ::munmap(bounce_, page_size_);
+}
+
+std::shared_ptr<char>
+FileCacheLazy::Map(int fd, size_t len, size_t file_bytes)
+{
+    len = (len + page_size_ - 1) / page_size_ * page_size_;
+    void *p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return std::shared_ptr<char>();
+    }
+    char *buf = (char *)p;
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uintptr_t)buf;
+    reg.range.len = len;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    Region region;
+    region.len = len;
+    region.file_bytes = std::min(file_bytes, len);
+    region.fd = ::dup(fd);
+    if (region.fd < 0 || ::ioctl(uffd_, UFFDIO_REGISTER, &reg) < 0) {
+        std::ostringstream err_str;
+        err_str << "Error registering lazy buffer : " << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        if (region.fd >= 0) {
+            ::close(region.fd);
+        }
+        ::munmap(buf, len);
+        return std::shared_ptr<char>();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        regions_[buf] = region;
+    }
+    std::shared_ptr<FileCacheLazy> self = shared_from_this();
+    return std::shared_ptr<char>(buf, [self](char *b) { self->unmap(b); });
+}
+
+void
+FileCacheLazy::unmap(char *buf)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    auto ritr = regions_.find(buf);
+    //Unmapping also unregisters the range
+    ::munmap(buf, ritr->second.len);
+    ::close(ritr->second.fd);
+    regions_.erase(ritr);
+}
+
+/*fill_page
+ * Input: region, its start, page index and whether to wake the threads
+ *        waiting on that page, m_ held
+ * Output: the page copied in from the file, unless it already is. A read
+ *         error is reported and leaves the page zero filled, there is no
+ *         way to fail the access that faulted.
+ */
+void
+FileCacheLazy::fill_page(const Region& region, char *start, size_t page,
+                         bool wake)
+{
+    size_t offset = page * page_size_;
+    size_t want = 0;
+    if (offset < region.file_bytes) {
+        want = std::min(page_size_, region.file_bytes - offset);
+    }
+    size_t done = 0;
+    while (done < want) {
+        ssize_t nbytes = ::pread(region.fd, bounce_ + done, want - done,
+                                 offset + done);
+        if (nbytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes <= 0) {
+            if (nbytes < 0) {
+                std::ostringstream err_str;
+                err_str << "Error reading lazy page : " << strerror(errno);
+                fprintf(stderr, "%s\n", err_str.str().c_str());
+                errors_.fetch_add(1, std::memory_order_relaxed);
+            }
+            break;
+        }
+        done += nbytes;
+    }
+    memset(bounce_ + done, 0, page_size_ - done);
+
+    struct uffdio_copy copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.dst = (uintptr_t)(start + offset);
+    copy.src = (uintptr_t)bounce_;
+    copy.len = page_size_;
+    copy.mode = wake ? 0 : UFFDIO_COPY_MODE_DONTWAKE;
+    if (::ioctl(uffd_, UFFDIO_COPY, &copy) == 0) {
+        pages_.fetch_add(1, std::memory_order_relaxed);
+    } else if (errno == EEXIST && wake) {
+        //Filled by an earlier readahead, whose copy didn't wake anyone
+        struct uffdio_range range;
+        range.start = copy.dst;
+        range.len = page_size_;
+        ::ioctl(uffd_, UFFDIO_WAKE, &range);
+    }
+}
+
+void
+FileCacheLazy::handler_loop()
+{
+    struct pollfd fds[2];
+    fds[0].fd = uffd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fd_;
+    fds[1].events = POLLIN;
+    while (true) {
+        if (::poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error polling userfaultfd");
+            return;
+        }
+        if (fds[1].revents & POLLIN) {
+            return;
+        }
+        struct uffd_msg msg;
+        while (::read(uffd_, &msg, sizeof(msg)) == sizeof(msg)) {
+            if (msg.event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+            char *addr = (char *)(uintptr_t)msg.arg.pagefault.address;
+            std::lock_guard<std::mutex> lock(m_);
+            auto ritr = regions_.upper_bound(addr);
+            if (ritr == regions_.begin()) {
+                continue;
+            }
+            --ritr;
+            char *start = ritr->first;
+            const Region& region = ritr->second;
+            if (addr >= start + region.len) {
+                continue;
+            }
+            faults_.fetch_add(1, std::memory_order_relaxed);
+            size_t page = (addr - start) / page_size_;
+            size_t pages = region.len / page_size_;
+            size_t first = page > (size_t)readahead_pages_ ?
+                           page - readahead_pages_ : 0;
+            size_t last = std::min(pages - 1, page + readahead_pages_);
+            for (size_t p = first; p <= last; p++) {
+                if (p != page) {
+                    fill_page(region, start, p, false);
+                }
+            }
+            //The faulting page last, so the woken thread finds the
+            //readahead in place too
+            fill_page(region, start, page, true);
+        }
+    }
+}
@@ -0,0 +1,68 @@
+
+#ifndef _FILE_CACHE_LAZY_H_
+#define _FILE_CACHE_LAZY_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stddef.h>
+#include <stdint.h>
+
+/* FileCacheLazy
+ * Buffers that are filled from their file on first touch, for
+ * FileCacheOptions::lazy_load. Map() only reserves address space and
+ * registers it with a userfaultfd; the first access to each page, from
+ * user code or from inside a system call, blocks until a handler thread
+ * has read that page and up to 'readahead_pages' on either side of it
+ * from the file and copied them in. Untouched pages cost no I/O and no
+ * memory.
+ *
+ * Needs userfaultfd without UFFD_USER_MODE_ONLY, since write-back hands
+ * buffers to write(): root, CAP_SYS_PTRACE or
+ * vm.unprivileged_userfaultfd=1. Buffers hold a reference to the object,
+ * so it lives until the last of them is freed.
+ */
+class FileCacheLazy : public std::enable_shared_from_this<FileCacheLazy> {
+public:
+    // Throws std::runtime_error if userfaultfd is not available.
+    static std::shared_ptr<FileCacheLazy> Create(int readahead_pages);
+    ~FileCacheLazy();
+
+    // 'len' bytes read from 'fd' at first touch, bytes past 'file_bytes'
+    // as zeros. 'fd' is dup()ed, the caller keeps its own. Returns an
+    // empty pointer on failure.
+    std::shared_ptr<char> Map(int fd, size_t len, size_t file_bytes);
+
+    // Faults resolved, pages filled including readahead, failed reads
+    uint64_t Faults() const { return faults_.load(std::memory_order_relaxed); }
+    uint64_t Pages() const { return pages_.load(std::memory_order_relaxed); }
+    uint64_t Errors() const { return errors_.load(std::memory_order_relaxed); }
+
+private:
+    struct Region {
+        int fd;
+        size_t len;
+        size_t file_bytes;
+    };
+
+    explicit FileCacheLazy(int readahead_pages);
+    void handler_loop();
+    void fill_page(const Region& region, char *start, size_t page, bool wake);
+    void unmap(char *buf);
+
+    int uffd_;
+    int stop_fd_;               //eventfd that ends handler_loop()
+    int readahead_pages_;
+    size_t page_size_;
+    char *bounce_;              //page the handler reads into
+    std::mutex m_;              //guards regions_
+    std::map<char *, Region> regions_;
+    std::atomic<uint64_t> faults_;
+    std::atomic<uint64_t> pages_;
+    std::atomic<uint64_t> errors_;
+    std::thread handler_;
+};
+
+#endif // _FILE_CACHE_LAZY_H_
@@ -0,0 +1,193 @@
+#include "file_cache_lz.h"
+#include <stdint.h>
+#include <string.h>
+
+/* LZ4 block format: a sequence of
+ *   token     high nibble literal count, low nibble match length - 4,
+ *             15 in either means more length bytes follow
+ *   [length]  bytes of 255 until one below, added to the literal count
+ *   literals
+ *   offset    2 bytes little endian, distance back to the match
+ *   [length]  as above, for the match length
+ * The last sequence has literals only. The format requires the last 5
+ * bytes to be literals and no match to start in the last 12.
+ */
+static const size_t kMinMatch = 4;
+static const size_t kLastLiterals = 5;
+static const size_t kMatchStartLimit = 12;
+static const int kHashBits = 12;
+static const size_t kMaxOffset = 65535;
+
+static uint32_t
+read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t
+hash_sequence(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - kHashBits);
+}
+
+static bool
+put_length(char *&op, const char *end, size_t len)
+{
+    while (len >= 255) {
+        if (op >= end) {
+            return false;
+        }
+        *op++ = (char)255;
+        len -= 255;
+    }
+    if (op >= end) {
+        return false;
+    }
+    *op++ = (char)len;
+    return true;
+}
+
+/*put_sequence
+ * Appends literals [lit, lit + lit_len) and, if match_len is non-zero, a
+ * match of that length at 'offset'. False if dst runs out.
+ */
+static bool
+put_sequence(char *&op, const char *end, const char *lit, size_t lit_len,
+             size_t offset, size_t match_len)
+{
+    if (op >= end) {
+        return false;
+    }
+    char *token = op++;
+    size_t match_code = match_len ? match_len - kMinMatch : 0;
+    *token = (char)(((lit_len < 15 ? lit_len : 15) << 4) |
+                    (match_code < 15 ? match_code : 15));
+    if (lit_len >= 15 && !put_length(op, end, lit_len - 15)) {
+        return false;
+    }
+    if ((size_t)(end - op) < lit_len) {
+        return false;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        return true;
+    }
+    if (end - op < 2) {
+        return false;
+    }
+    *op++ = (char)(offset & 0xff);
+    *op++ = (char)(offset >> 8);
+    return match_code < 15 || put_length(op, end, match_code - 15);
+}
+
+size_t
+FileCacheLzCompress(const char *src, size_t len, char *dst, size_t capacity)
+{
+    char *op = dst;
+    const char *end = dst + capacity;
+    size_t anchor = 0;
+    if (len > kMatchStartLimit) {
+        //Positions + 1, so 0 means empty
+        uint32_t table[1 << kHashBits];
+        memset(table, 0, sizeof(table));
+        size_t match_start_limit = len - kMatchStartLimit;
+        size_t match_end_limit = len - kLastLiterals;
+        size_t ip = 0;
+        while (ip < match_start_limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash_sequence(seq);
+            size_t ref = table[h];
+            table[h] = ip + 1;
+            if (ref == 0 || ip - (ref - 1) > kMaxOffset ||
+                read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+            size_t match_len = kMinMatch;
+            while (ip + match_len < match_end_limit &&
+                   src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+            if (!put_sequence(op, end, src + anchor, ip - anchor, ip - ref,
+                              match_len)) {
+                return 0;
+            }
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+    if (!put_sequence(op, end, src + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+static bool
+get_length(const char *&ip, const char *end, size_t& len)
+{
+    uint8_t byte;
+    do {
+        if (ip >= end) {
+            return false;
+        }
+        byte = *ip++;
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool
+FileCacheLzDecompress(const char *src, size_t src_len, char *dst, size_t len)
+{
+    const char *ip = src;
+    const char *ip_end = src + src_len;
+    size_t out = 0;
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_length(ip, ip_end, lit_len)) {
+            return false;
+        }
+        if ((size_t)(ip_end - ip) < lit_len || len - out < lit_len) {
+            return false;
+        }
+        memcpy(dst + out, ip, lit_len);
+        ip += lit_len;
+        out += lit_len;
+        if (ip == ip_end) {
+            //Last sequence
+            break;
+        }
+        if (ip_end - ip < 2) {
+            return false;
+        }
+        size_t offset = (uint8_t)ip[0] | ((size_t)(uint8_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(ip, ip_end, match_len)) {
+            return false;
+        }
+        match_len += kMinMatch;
+        if (offset == 0 || offset > out || len - out < match_len) {
+            return false;
+        }
+        //The match may overlap what it produces. Copy one period, then
+        //the doubled pattern, so runs like zero fill take a few memcpys.
+        char *op = dst + out;
+        size_t distance = offset;
+        size_t left = match_len;
+        while (left > 0) {
+            size_t n = left < distance ? left : distance;
+            memcpy(op, op - distance, n);
+            op += n;
+            left -= n;
+            distance += n;
+        }
+        out += match_len;
+    }
+    return out == len;
+}
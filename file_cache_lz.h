@@ -0,0 +1,21 @@
+
+#ifndef _FILE_CACHE_LZ_H_
+#define _FILE_CACHE_LZ_H_
+
+#include <stddef.h>
+
+// Small LZ77 codec producing LZ4 block format: greedy matching with a
+// 4096 entry hash table of 4 byte sequences, 64KB window. Roughly LZ4's
+// ratio at its default level, without the dependency.
+
+// Compresses 'len' bytes into 'dst'. Returns the compressed size, or 0 if
+// it would not fit in 'capacity' bytes.
+size_t FileCacheLzCompress(const char *src, size_t len, char *dst,
+                           size_t capacity);
+
+// Decompresses into exactly 'len' bytes at 'dst'. Returns false if the
+// input is malformed or does not decode to 'len' bytes.
+bool FileCacheLzDecompress(const char *src, size_t src_len, char *dst,
+                           size_t len);
+
+#endif // _FILE_CACHE_LZ_H_
@@ -0,0 +1,212 @@
+#include "file_cache_numa.h"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+//Buffers carved from each chunk, so a chunk of 10KB files is about 1.5MB
+static const size_t kBufsPerChunk = 128;
+static const int kMaxNodes = 64;
+
+/*parse_cpu_list
+ * Input: a kernel cpu or node list such as "0-3,8,10-11"
+ * Output: the numbers it lists
+ */
+static std::vector<int>
+parse_cpu_list(const std::string& list)
+{
+    std::vector<int> ids;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        int first;
+        int last;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1) {
+            continue;
+        }
+        if (n == 1) {
+            last = first;
+        }
+        for (int id = first; id <= last; id++) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+static std::string
+read_line(const std::string& path)
+{
+    std::ifstream in(path.c_str());
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+int
+FileCacheNumaPool::Nodes()
+{
+    static int nodes = []() {
+        int max_node = 0;
+        for (int node : parse_cpu_list(
+                    read_line("/sys/devices/system/node/possible"))) {
+            if (node > max_node) {
+                max_node = node;
+            }
+        }
+        return max_node + 1 < kMaxNodes ? max_node + 1 : kMaxNodes;
+    }();
+    return nodes;
+}
+
+int
+FileCacheNumaPool::CurrentNode()
+{
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) < 0) {
+        return 0;
+    }
+    return (int)node % Nodes();
+}
+
+int
+FileCacheNumaPool::NodeOf(const void *p)
+{
+    int node = -1;
+    uintptr_t page = (uintptr_t)p & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, (void *)page,
+                MPOL_F_NODE | MPOL_F_ADDR) < 0) {
+        return -1;
+    }
+    return node;
+}
+
+bool
+FileCacheNumaPool::Bind(void *addr, size_t len, int node)
+{
+    unsigned long mask = 1UL << (node % Nodes());
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask,
+                sizeof(mask) * 8, 0) < 0) {
+        //ENOSYS without NUMA support, where there is nothing to bind
+        return errno == ENOSYS;
+    }
+    return true;
+}
+
+bool
+FileCacheNumaPool::RunOnNode(int node)
+{
+    std::ostringstream path;
+    path << "/sys/devices/system/node/node" << node % Nodes() << "/cpulist";
+    std::vector<int> cpus = parse_cpu_list(read_line(path.str()));
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+std::shared_ptr<FileCacheNumaPool>
+FileCacheNumaPool::Create(size_t buf_size)
+{
+    return std::shared_ptr<FileCacheNumaPool>(new FileCacheNumaPool(buf_size));
+}
+
+FileCacheNumaPool::FileCacheNumaPool(size_t buf_size) :
+    nodes_(Nodes())
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    buf_size_ = (buf_size + page - 1) / page * page;
+    chunk_size_ = buf_size_ * kBufsPerChunk;
+    arenas_.reset(new Arena[nodes_]);
+}
+
+FileCacheNumaPool::~FileCacheNumaPool()
+{
+    for (int node = 0; node < nodes_; node++) {
+        for (char *chunk : arenas_[node].chunks) {
+            ::munmap(chunk, chunk_size_);
+        }
+    }
+}
+
+/*grow
+ * Input: arena of 'node' with an empty free list, its lock held
+ * Output: false if no chunk could be mapped. Otherwise a new chunk bound
+ *         to the node has been split into free buffers.
+ */
+bool
+FileCacheNumaPool::grow(Arena& arena, int node)
+{
+    void *p = ::mmap(nullptr, chunk_size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    char *chunk = (char *)p;
+    if (!Bind(chunk, chunk_size_, node)) {
+        fprintf(stderr, "Error binding buffers to NUMA node %d : %s\n",
+                node, strerror(errno));
+    }
+    arena.chunks.push_back(chunk);
+    for (size_t i = kBufsPerChunk; i > 0; i--) {
+        arena.free_bufs.push_back(chunk + (i - 1) * buf_size_);
+    }
+    return true;
+}
+
+std::shared_ptr<char>
+FileCacheNumaPool::Allocate(int node)
+{
+    node = (node < 0 ? 0 : node) % nodes_;
+    Arena& arena = arenas_[node];
+    char *buf;
+    {
+        std::lock_guard<std::mutex> lock(arena.m);
+        if (arena.free_bufs.empty() && !grow(arena, node)) {
+            return std::shared_ptr<char>();
+        }
+        buf = arena.free_bufs.back();
+        arena.free_bufs.pop_back();
+    }
+    arena.in_use.fetch_add(1, std::memory_order_relaxed);
+    arena.allocations.fetch_add(1, std::memory_order_relaxed);
+    std::shared_ptr<FileCacheNumaPool> self = shared_from_this();
+    return std::shared_ptr<char>(buf, [self, node](char *b) {
+        self->free_buf(b, node);
+    });
+}
+
+void
+FileCacheNumaPool::free_buf(char *buf, int node)
+{
+    Arena& arena = arenas_[node];
+    std::lock_guard<std::mutex> lock(arena.m);
+    arena.free_bufs.push_back(buf);
+    arena.in_use.fetch_sub(1, std::memory_order_relaxed);
+}
+
+int64_t
+FileCacheNumaPool::InUse(int node) const
+{
+    return arenas_[node].in_use.load(std::memory_order_relaxed);
+}
+
+uint64_t
+FileCacheNumaPool::Allocations(int node) const
+{
+    return arenas_[node].allocations.load(std::memory_order_relaxed);
+}
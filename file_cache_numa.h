@@ -0,0 +1,69 @@
+
+#ifndef _FILE_CACHE_NUMA_H_
+#define _FILE_CACHE_NUMA_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/* FileCacheNumaPool
+ * Per-node arenas of fixed size buffers, for
+ * FileCacheOptions::numa_placement. Each node's arena carves page aligned
+ * buffers out of chunks bound to that node with mbind(MPOL_PREFERRED),
+ * so their pages land on the node whichever thread touches them first,
+ * and only spill to other nodes when it is out of memory. Freed buffers
+ * go back on their node's free list; chunks are kept until the pool goes
+ * away, which is after the last buffer, since buffers hold a reference.
+ *
+ * Uses the raw system calls rather than libnuma. On kernels without NUMA
+ * everything is node 0 and binding is a no-op.
+ */
+class FileCacheNumaPool :
+    public std::enable_shared_from_this<FileCacheNumaPool> {
+public:
+    static std::shared_ptr<FileCacheNumaPool> Create(size_t buf_size);
+    ~FileCacheNumaPool();
+
+    // Buffer on 'node' (taken modulo Nodes()), empty on failure.
+    std::shared_ptr<char> Allocate(int node);
+
+    // Buffers of this pool in use on 'node', and allocated there so far
+    int64_t InUse(int node) const;
+    uint64_t Allocations(int node) const;
+
+    // Number of possible nodes, at least 1.
+    static int Nodes();
+    // Node of the CPU the calling thread runs on.
+    static int CurrentNode();
+    // Node the page holding 'p' is on, -1 if unknown.
+    static int NodeOf(const void *p);
+    // Prefers 'node' for the pages of [addr, addr + len), a page aligned
+    // mapping, as they are first touched.
+    static bool Bind(void *addr, size_t len, int node);
+    // Restricts the calling thread to the CPUs of 'node'.
+    static bool RunOnNode(int node);
+
+private:
+    struct Arena {
+        Arena() : in_use(0), allocations(0) {}
+        std::mutex m;
+        std::vector<char *> free_bufs;
+        std::vector<char *> chunks;
+        std::atomic<int64_t> in_use;
+        std::atomic<uint64_t> allocations;
+    };
+
+    explicit FileCacheNumaPool(size_t buf_size);
+    bool grow(Arena& arena, int node);
+    void free_buf(char *buf, int node);
+
+    size_t buf_size_;           //rounded up to whole pages
+    size_t chunk_size_;
+    std::unique_ptr<Arena[]> arenas_;
+    int nodes_;
+};
+
+#endif // _FILE_CACHE_NUMA_H_
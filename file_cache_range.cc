@@ -0,0 +1,206 @@
+#include "file_cache_range.h"
+#include <sstream>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const size_t kBlockAlign = 4096;
+
+FileCacheRangeTable::FileCacheRangeTable(size_t block_size, uint64_t capacity,
+                                         FileCacheCounters& counters) :
+    block_size_((block_size + kBlockAlign - 1) / kBlockAlign * kBlockAlign),
+    capacity_(capacity),
+    counters_(counters),
+    resident_bytes_(0)
+{
+    if (block_size_ == 0) {
+        block_size_ = kBlockAlign;
+    }
+}
+
+FileCacheRangeTable::~FileCacheRangeTable()
+{
+    for (auto& file : files_) {
+        ::close(file.second.fd);
+    }
+}
+
+/*open_file
+ * Input: filename, m_ held
+ * Output: its block table, opening the file if it has none, or nullptr
+ */
+FileCacheRangeTable::RangeFile *
+FileCacheRangeTable::open_file(const std::string& name)
+{
+    auto fitr = files_.find(name);
+    if (fitr != files_.end()) {
+        return &fitr->second;
+    }
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::ostringstream err_str;
+        err_str << "Error opening file " << name << " : " << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        counters_.Add(FileCacheCounters::kIoErrors);
+        return nullptr;
+    }
+    RangeFile& rf = files_[name];
+    rf.fd = fd;
+    rf.name = name;
+    return &rf;
+}
+
+/*load_block
+ * Input: file, block index and the new, empty block for it, m_ held
+ * Output: false if the read failed
+ */
+bool
+FileCacheRangeTable::load_block(RangeFile& rf, uint64_t index, Block& block)
+{
+    block.buf.reset(new char[block_size_]);
+    size_t done = 0;
+    while (done < block_size_) {
+        ssize_t nbytes = ::pread(rf.fd, block.buf.get() + done,
+                                 block_size_ - done,
+                                 (off_t)(index * block_size_ + done));
+        if (nbytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes < 0) {
+            std::ostringstream err_str;
+            err_str << "Error reading file " << rf.name
+                    << " : " << strerror(errno);
+            fprintf(stderr, "%s\n", err_str.str().c_str());
+            counters_.Add(FileCacheCounters::kIoErrors);
+            block.buf.reset();
+            return false;
+        }
+        if (nbytes == 0) {
+            //Past the end of the file
+            memset(block.buf.get() + done, 0, block_size_ - done);
+            break;
+        }
+        done += nbytes;
+    }
+    resident_bytes_.fetch_add(block_size_, std::memory_order_relaxed);
+    counters_.Add(FileCacheCounters::kRangeBlockLoads);
+    return true;
+}
+
+void
+FileCacheRangeTable::unpin_block(RangeFile& rf, uint64_t index)
+{
+    auto bitr = rf.blocks.find(index);
+    if (bitr == rf.blocks.end() || bitr->second.pins == 0) {
+        return;
+    }
+    Block& block = bitr->second;
+    if (--block.pins == 0) {
+        block.lru_pos = lru_.insert(lru_.end(), std::make_pair(&rf, index));
+    }
+}
+
+void
+FileCacheRangeTable::drop_file_if_empty(RangeFile& rf)
+{
+    if (rf.blocks.empty()) {
+        //Erasing by iterator, the key is rf.name itself
+        ::close(rf.fd);
+        files_.erase(files_.find(rf.name));
+    }
+}
+
+/*evict_blocks
+ * Frees unpinned blocks, least recently used first, until the table is
+ * within capacity_ or nothing is left to evict. m_ held.
+ */
+void
+FileCacheRangeTable::evict_blocks()
+{
+    while ((uint64_t)resident_bytes_.load(std::memory_order_relaxed) >
+           capacity_ && !lru_.empty()) {
+        RangeFile *rf = lru_.front().first;
+        uint64_t index = lru_.front().second;
+        lru_.pop_front();
+        rf->blocks.erase(index);
+        resident_bytes_.fetch_sub(block_size_, std::memory_order_relaxed);
+        counters_.Add(FileCacheCounters::kRangeBlockEvictions);
+        drop_file_if_empty(*rf);
+    }
+}
+
+bool
+FileCacheRangeTable::Pin(const std::string& name, uint64_t offset, size_t len)
+{
+    if (len == 0) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    RangeFile *rf = open_file(name);
+    if (rf == nullptr) {
+        return false;
+    }
+    uint64_t first = offset / block_size_;
+    uint64_t last = (offset + len - 1) / block_size_;
+    for (uint64_t index = first; index <= last; index++) {
+        auto bitr = rf->blocks.find(index);
+        if (bitr == rf->blocks.end()) {
+            bitr = rf->blocks.emplace(index, Block()).first;
+            if (!load_block(*rf, index, bitr->second)) {
+                rf->blocks.erase(bitr);
+                for (uint64_t i = first; i < index; i++) {
+                    unpin_block(*rf, i);
+                }
+                drop_file_if_empty(*rf);
+                return false;
+            }
+        } else if (bitr->second.pins == 0) {
+            lru_.erase(bitr->second.lru_pos);
+        }
+        bitr->second.pins++;
+    }
+    evict_blocks();
+    return true;
+}
+
+void
+FileCacheRangeTable::Unpin(const std::string& name, uint64_t offset,
+                           size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    auto fitr = files_.find(name);
+    if (fitr == files_.end()) {
+        return;
+    }
+    uint64_t first = offset / block_size_;
+    uint64_t last = (offset + len - 1) / block_size_;
+    for (uint64_t index = first; index <= last; index++) {
+        unpin_block(fitr->second, index);
+    }
+    evict_blocks();
+}
+
+const char *
+FileCacheRangeTable::Data(const std::string& name, uint64_t offset,
+                          size_t& len)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    auto fitr = files_.find(name);
+    if (fitr == files_.end()) {
+        return nullptr;
+    }
+    auto bitr = fitr->second.blocks.find(offset / block_size_);
+    if (bitr == fitr->second.blocks.end() || bitr->second.pins == 0) {
+        return nullptr;
+    }
+    size_t in_block = offset % block_size_;
+    if (len > block_size_ - in_block) {
+        len = block_size_ - in_block;
+    }
+    return bitr->second.buf.get() + in_block;
+}
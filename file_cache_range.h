@@ -0,0 +1,87 @@
+
+#ifndef _FILE_CACHE_RANGE_H_
+#define _FILE_CACHE_RANGE_H_
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include "file_cache_stats.h"
+
+/* FileCacheRangeTable
+ * Read-only cache of fixed size blocks of files of any size, behind
+ * FileCacheImpl::PinRange(). Each open file has a block table from block
+ * index to buffer, and only the blocks a pinned range touches are read,
+ * so a small read of a huge file costs one block of memory and I/O.
+ *
+ * Blocks are pinned and evicted one at a time. Unpinned blocks wait on
+ * an LRU list and the least recently used go once more than 'capacity'
+ * bytes are resident; pinned blocks are never evicted and can push the
+ * table past its capacity. A file's descriptor is closed when its last
+ * block goes. Bytes past the end of a file read as zeros.
+ *
+ * All methods are thread safe. Loads happen under the table's lock.
+ */
+class FileCacheRangeTable {
+public:
+    // 'block_size' is rounded up to a multiple of 4096. Loads, evictions
+    // and I/O errors are counted in 'counters'.
+    FileCacheRangeTable(size_t block_size, uint64_t capacity,
+                        FileCacheCounters& counters);
+    ~FileCacheRangeTable();
+
+    // Loads the blocks covering [offset, offset + len) that are not
+    // resident and pins them all. False, with nothing pinned, if the file
+    // can't be opened or a block can't be read.
+    bool Pin(const std::string& name, uint64_t offset, size_t len);
+    // Drops the pins Pin() took for the same range.
+    void Unpin(const std::string& name, uint64_t offset, size_t len);
+
+    // Pointer to byte 'offset' of 'name', whose block must be pinned
+    // (nullptr otherwise). 'len' is trimmed to the bytes readable there,
+    // which stop at the end of the block.
+    const char *Data(const std::string& name, uint64_t offset, size_t& len);
+
+    size_t BlockSize() const { return block_size_; }
+    int64_t ResidentBytes() const
+    {
+        return resident_bytes_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct RangeFile;
+    struct Block {
+        Block() : pins(0) {}
+        std::unique_ptr<char[]> buf;
+        uint32_t pins;
+        //Position on lru_ while unpinned
+        std::list<std::pair<RangeFile *, uint64_t> >::iterator lru_pos;
+    };
+    struct RangeFile {
+        RangeFile() : fd(-1) {}
+        int fd;
+        std::string name;
+        std::unordered_map<uint64_t, Block> blocks;
+    };
+
+    size_t block_size_;
+    uint64_t capacity_;
+    FileCacheCounters& counters_;
+    std::mutex m_;
+    std::map<std::string, RangeFile> files_;
+    //Unpinned blocks as (file, block index), least recently used first
+    std::list<std::pair<RangeFile *, uint64_t> > lru_;
+    std::atomic<int64_t> resident_bytes_;
+
+    RangeFile *open_file(const std::string& name);
+    bool load_block(RangeFile& rf, uint64_t index, Block& block);
+    void unpin_block(RangeFile& rf, uint64_t index);
+    void evict_blocks();
+    void drop_file_if_empty(RangeFile& rf);
+};
+
+#endif // _FILE_CACHE_RANGE_H_
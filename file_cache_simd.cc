@@ -0,0 +1,205 @@
+#include "file_cache_simd.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILE_CACHE_X86 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define FILE_CACHE_NEON 1
+#endif
+
+namespace {
+
+//Bytes handled per loop iteration by the vector paths
+const size_t kStep = 128;
+
+#if FILE_CACHE_X86
+__attribute__((target("avx2")))
+bool
+equal_avx2(const char *a, const char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + kStep <= len; i += kStep) {
+        __m256i diff = _mm256_setzero_si256();
+        for (size_t j = 0; j < kStep; j += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a + i + j));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(b + i + j));
+            diff = _mm256_or_si256(diff, _mm256_xor_si256(x, y));
+        }
+        if (!_mm256_testz_si256(diff, diff)) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+bool
+equal_sse2(const char *a, const char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + kStep <= len; i += kStep) {
+        __m128i diff = _mm_setzero_si128();
+        for (size_t j = 0; j < kStep; j += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + i + j));
+            __m128i y = _mm_loadu_si128((const __m128i *)(b + i + j));
+            diff = _mm_or_si128(diff, _mm_xor_si128(x, y));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) !=
+            0xffff) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+typedef bool (*equal_fn)(const char *, const char *, size_t);
+
+equal_fn
+pick_equal()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? equal_avx2 : equal_sse2;
+}
+#elif FILE_CACHE_NEON
+bool
+equal_neon(const char *a, const char *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + kStep <= len; i += kStep) {
+        uint8x16_t diff = vdupq_n_u8(0);
+        for (size_t j = 0; j < kStep; j += 16) {
+            uint8x16_t x = vld1q_u8((const uint8_t *)(a + i + j));
+            uint8x16_t y = vld1q_u8((const uint8_t *)(b + i + j));
+            diff = vorrq_u8(diff, veorq_u8(x, y));
+        }
+        if (vmaxvq_u8(diff) != 0) {
+            return false;
+        }
+    }
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+#endif
+
+//A page of zeros to compare against in FileCacheBufferIsZero
+const char zeros[kStep * 32] = {};
+
+const uint64_t kPrime1 = 11400714785074694791ULL;
+const uint64_t kPrime2 = 14029467366897019727ULL;
+const uint64_t kPrime3 = 1609587929392839161ULL;
+const uint64_t kPrime4 = 9650029242287828579ULL;
+const uint64_t kPrime5 = 2870177450012600261ULL;
+
+inline uint64_t
+rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t
+read64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t
+read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+    acc += input * kPrime2;
+    acc = rotl(acc, 31);
+    return acc * kPrime1;
+}
+
+inline uint64_t
+merge64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * kPrime1 + kPrime4;
+}
+
+} // namespace
+
+bool
+FileCacheBuffersEqual(const char *a, const char *b, size_t len)
+{
+#if FILE_CACHE_X86
+    static const equal_fn equal = pick_equal();
+    return equal(a, b, len);
+#elif FILE_CACHE_NEON
+    return equal_neon(a, b, len);
+#else
+    return memcmp(a, b, len) == 0;
+#endif
+}
+
+bool
+FileCacheBufferIsZero(const char *p, size_t len)
+{
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (!FileCacheBuffersEqual(p, zeros, n)) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+uint64_t
+FileCacheHash64(const char *p, size_t len, uint64_t seed)
+{
+    const char *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+        const char *limit = end - 32;
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge64(h, v1);
+        h = merge64(h, v2);
+        h = merge64(h, v3);
+        h = merge64(h, v4);
+    } else {
+        h = seed + kPrime5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * kPrime1 + kPrime4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * kPrime1;
+        h = rotl(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (uint8_t)*p * kPrime5;
+        h = rotl(h, 11) * kPrime1;
+    }
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,21 @@
+
+#ifndef _FILE_CACHE_SIMD_H_
+#define _FILE_CACHE_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffer primitives for the clean-copy check and dedup paths.
+
+// True if the 'len' bytes at 'a' and 'b' are identical. Uses AVX2 when
+// the CPU has it, SSE2 or NEON otherwise, compares 128 bytes per step.
+bool FileCacheBuffersEqual(const char *a, const char *b, size_t len);
+
+// True if all 'len' bytes at 'p' are zero, same vector paths as above.
+bool FileCacheBufferIsZero(const char *p, size_t len);
+
+// 64-bit XXH64 hash of 'len' bytes. Four independent lanes per 32 byte
+// stripe keep the multipliers busy, several GB/s on one core.
+uint64_t FileCacheHash64(const char *p, size_t len, uint64_t seed = 0);
+
+#endif // _FILE_CACHE_SIMD_H_
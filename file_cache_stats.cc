@@ -0,0 +1,303 @@
+#include "file_cache_stats.h"
+#include <sstream>
+
+FileCacheCounters::FileCacheCounters()
+{
+    for (int s = 0; s < kNumShards; s++) {
+        for (int c = 0; c < kNumCounters; c++) {
+            shards_[s].v_[c].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t
+FileCacheCounters::Sum(Counter counter) const
+{
+    uint64_t total = 0;
+    for (int s = 0; s < kNumShards; s++) {
+        total += shards_[s].v_[counter].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+/*shard_index
+ * Output: shard owned by the calling thread. Threads are handed shards
+ * round robin the first time they touch any counter.
+ */
+int
+FileCacheCounters::shard_index()
+{
+    static std::atomic<unsigned> next_shard(0);
+    static thread_local int shard =
+        next_shard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+    return shard;
+}
+
+FileCacheHistogram::FileCacheHistogram() : sum_ns_(0), max_ns_(0)
+{
+    for (int b = 0; b < kNumBuckets; b++) {
+        counts_[b].store(0, std::memory_order_relaxed);
+    }
+}
+
+/*BucketIndex
+ * Input: recorded value in nanoseconds
+ * Output: index of the bucket holding it
+ */
+int
+FileCacheHistogram::BucketIndex(uint64_t ns)
+{
+    if (ns < (uint64_t)2 * kSubBuckets) {
+        return (int)ns;
+    }
+    if (ns >= ((uint64_t)1 << kMaxExponent)) {
+        return kNumBuckets - 1;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - kSubBucketBits;
+    int sub = (int)((ns >> shift) & (kSubBuckets - 1));
+    return (shift + 1) * kSubBuckets + sub;
+}
+
+uint64_t
+FileCacheHistogram::BucketLowerBound(int bucket)
+{
+    if (bucket < 2 * kSubBuckets) {
+        return bucket;
+    }
+    int shift = bucket / kSubBuckets - 1;
+    uint64_t sub = bucket % kSubBuckets;
+    return (kSubBuckets + sub) << shift;
+}
+
+void
+FileCacheHistogram::Record(uint64_t ns)
+{
+    counts_[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = max_ns_.load(std::memory_order_relaxed);
+    while (ns > max &&
+           !max_ns_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+/*Snapshot
+ * Input: whether to zero the histogram while copying it
+ * Output: copy of the buckets. Recording is not paused, so with 'reset' a
+ *         concurrent value lands either in this snapshot or the next one.
+ */
+FileCacheHistogramSnapshot
+FileCacheHistogram::Snapshot(bool reset)
+{
+    FileCacheHistogramSnapshot snap;
+    snap.counts.resize(kNumBuckets);
+    uint64_t count = 0;
+    for (int b = 0; b < kNumBuckets; b++) {
+        snap.counts[b] = reset ?
+            counts_[b].exchange(0, std::memory_order_relaxed) :
+            counts_[b].load(std::memory_order_relaxed);
+        count += snap.counts[b];
+    }
+    snap.count = count;
+    if (reset) {
+        snap.sum_ns = sum_ns_.exchange(0, std::memory_order_relaxed);
+        snap.max_ns = max_ns_.exchange(0, std::memory_order_relaxed);
+    } else {
+        snap.sum_ns = sum_ns_.load(std::memory_order_relaxed);
+        snap.max_ns = max_ns_.load(std::memory_order_relaxed);
+    }
+    return snap;
+}
+
+uint64_t
+FileCacheHistogramSnapshot::Percentile(double q) const
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    } else if (rank > count) {
+        rank = count;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < counts.size(); b++) {
+        seen += counts[b];
+        if (seen >= rank) {
+            uint64_t upper = FileCacheHistogram::BucketLowerBound(b + 1);
+            //Never report more than was actually recorded
+            return (upper < max_ns || max_ns == 0) ? upper : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+static void
+prometheus_histogram(std::ostringstream& out, const char *op,
+                     const FileCacheHistogramSnapshot& snap)
+{
+    //Power of two boundaries line up with the sub-bucket edges
+    const int kFirstExponent = 10;
+    const int kLastExponent = 36;
+    size_t b = 0;
+    uint64_t cumulative = 0;
+    for (int e = kFirstExponent; e <= kLastExponent; e++) {
+        uint64_t bound = (uint64_t)1 << e;
+        while (b < snap.counts.size() &&
+               FileCacheHistogram::BucketLowerBound(b) < bound) {
+            cumulative += snap.counts[b++];
+        }
+        out << "file_cache_latency_seconds_bucket{op=\"" << op << "\",le=\""
+            << bound / 1e9 << "\"} " << cumulative << "\n";
+    }
+    out << "file_cache_latency_seconds_bucket{op=\"" << op
+        << "\",le=\"+Inf\"} " << snap.count << "\n";
+    out << "file_cache_latency_seconds_sum{op=\"" << op << "\"} "
+        << snap.sum_ns / 1e9 << "\n";
+    out << "file_cache_latency_seconds_count{op=\"" << op << "\"} "
+        << snap.count << "\n";
+}
+
+//Takes the value's own type, so counters and gauges are written as exact
+//integers and only seconds as doubles
+template <typename T>
+static void
+prometheus_metric(std::ostringstream& out, const char *name,
+                  const char *type, const char *help, T value)
+{
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+    out << name << " " << value << "\n";
+}
+
+std::string
+FileCachePrometheusText(const FileCacheStats& stats,
+                        const FileCacheLatency& latency)
+{
+    std::ostringstream out;
+    out.precision(9);
+    prometheus_metric(out, "file_cache_hits_total", "counter",
+            "PinFiles requests served from the cache.", stats.hits);
+    prometheus_metric(out, "file_cache_misses_total", "counter",
+            "PinFiles requests read from storage.", stats.misses);
+    out << "# HELP file_cache_evictions_total Entries evicted.\n";
+    out << "# TYPE file_cache_evictions_total counter\n";
+    out << "file_cache_evictions_total{state=\"clean\"} "
+        << stats.clean_evictions << "\n";
+    out << "file_cache_evictions_total{state=\"dirty\"} "
+        << stats.dirty_evictions << "\n";
+    prometheus_metric(out, "file_cache_write_backs_total", "counter",
+            "Dirty buffers written to storage.", stats.write_backs);
+    prometheus_metric(out, "file_cache_write_back_bytes_total", "counter",
+            "Bytes written back to storage.", stats.write_back_bytes);
+    prometheus_metric(out, "file_cache_skipped_write_backs_total", "counter",
+            "Dirty entries whose contents had not changed.",
+            stats.skipped_write_backs);
+    prometheus_metric(out, "file_cache_skipped_write_back_bytes_total",
+            "counter", "Dirty bytes not written because they had not changed.",
+            stats.skipped_write_back_bytes);
+    prometheus_metric(out, "file_cache_syncs_total", "counter",
+            "File and directory syncs issued by write-back and Flush().",
+            stats.syncs);
+    prometheus_metric(out, "file_cache_wal_bytes_total", "counter",
+            "Page bytes appended to the write-ahead log.", stats.wal_bytes);
+    prometheus_metric(out, "file_cache_wal_checkpoints_total", "counter",
+            "Times the write-ahead log was emptied.", stats.wal_checkpoints);
+    prometheus_metric(out, "file_cache_wal_recovered_batches_total",
+            "counter", "Log batches replayed at startup.",
+            stats.wal_recovered_batches);
+    prometheus_metric(out, "file_cache_prefetches_total", "counter",
+            "Entries loaded in the background from the warm restart index.",
+            stats.prefetches);
+    prometheus_metric(out, "file_cache_l2_hits_total", "counter",
+            "Misses served from the L2 tier.", stats.l2_hits);
+    prometheus_metric(out, "file_cache_l2_admissions_total", "counter",
+            "Evicted entries written to the L2 tier.", stats.l2_admissions);
+    prometheus_metric(out, "file_cache_l2_rejections_total", "counter",
+            "Evicted entries turned away by L2 admission control.",
+            stats.l2_rejections);
+    prometheus_metric(out, "file_cache_compressions_total", "counter",
+            "Entries moved to the compressed pool.", stats.compressions);
+    prometheus_metric(out, "file_cache_compressed_hits_total", "counter",
+            "Misses served from the compressed pool.", stats.compressed_hits);
+    prometheus_metric(out, "file_cache_compress_in_bytes_total", "counter",
+            "Bytes given to the compressor.", stats.compress_in_bytes);
+    prometheus_metric(out, "file_cache_compress_out_bytes_total", "counter",
+            "Bytes the compressor produced.", stats.compress_out_bytes);
+    prometheus_metric(out, "file_cache_zero_page_loads_total", "counter",
+            "All zero files backed by the shared zero page.",
+            stats.zero_page_loads);
+    prometheus_metric(out, "file_cache_copy_on_writes_total", "counter",
+            "Private buffers allocated on first mutation.",
+            stats.copy_on_writes);
+    prometheus_metric(out, "file_cache_dedup_hits_total", "counter",
+            "Loads that shared the buffer of an identical file.",
+            stats.dedup_hits);
+    prometheus_metric(out, "file_cache_snapshot_publishes_total", "counter",
+            "Write sessions published to snapshot readers.",
+            stats.snapshot_publishes);
+    prometheus_metric(out, "file_cache_txn_commits_total", "counter",
+            "Transactions committed.", stats.txn_commits);
+    prometheus_metric(out, "file_cache_txn_aborts_total", "counter",
+            "Transactions aborted.", stats.txn_aborts);
+    prometheus_metric(out, "file_cache_range_block_loads_total", "counter",
+            "Blocks read for range pins.", stats.range_block_loads);
+    prometheus_metric(out, "file_cache_range_block_evictions_total",
+            "counter", "Range blocks evicted.", stats.range_block_evictions);
+    prometheus_metric(out, "file_cache_lazy_faults_total", "counter",
+            "First touches of lazily loaded pages.", stats.lazy_faults);
+    prometheus_metric(out, "file_cache_lazy_pages_total", "counter",
+            "Pages filled on first touch, with readahead.", stats.lazy_pages);
+    prometheus_metric(out, "file_cache_front_cache_hits_total", "counter",
+            "FileData calls served by the per-thread front cache.",
+            stats.front_cache_hits);
+    prometheus_metric(out, "file_cache_io_errors_total", "counter",
+            "Failed open, read and write calls.", stats.io_errors);
+    prometheus_metric(out, "file_cache_wait_seconds_total", "counter",
+            "Time PinFiles spent blocked on a full cache.",
+            stats.wait_ns / 1e9);
+    prometheus_metric(out, "file_cache_pinned_entries", "gauge",
+            "Entries with a non-zero pin count.", stats.pinned_entries);
+    prometheus_metric(out, "file_cache_dirty_entries", "gauge",
+            "Entries waiting for write-back.", stats.dirty_entries);
+    prometheus_metric(out, "file_cache_resident_entries", "gauge",
+            "Entries held in the cache.", stats.resident_entries);
+    prometheus_metric(out, "file_cache_compressed_entries", "gauge",
+            "Entries held in the compressed pool.", stats.compressed_entries);
+    prometheus_metric(out, "file_cache_compressed_bytes", "gauge",
+            "Compressed bytes held in the compressed pool.",
+            stats.compressed_bytes);
+    prometheus_metric(out, "file_cache_dedup_saved_bytes", "gauge",
+            "Buffer memory saved by sharing identical files.",
+            stats.dedup_saved_bytes);
+    prometheus_metric(out, "file_cache_snapshot_versions", "gauge",
+            "Replaced versions kept for snapshot readers.",
+            stats.snapshot_versions);
+    prometheus_metric(out, "file_cache_range_bytes", "gauge",
+            "Block memory held for range pins.", stats.range_bytes);
+    if (!stats.numa_buffers.empty()) {
+        out << "# HELP file_cache_numa_buffers Pool buffers in use by node.\n";
+        out << "# TYPE file_cache_numa_buffers gauge\n";
+        for (size_t node = 0; node < stats.numa_buffers.size(); node++) {
+            out << "file_cache_numa_buffers{node=\"" << node << "\"} "
+                << stats.numa_buffers[node] << "\n";
+        }
+        out << "# HELP file_cache_numa_allocations_total Pool buffers "
+            << "allocated by node.\n";
+        out << "# TYPE file_cache_numa_allocations_total counter\n";
+        for (size_t node = 0; node < stats.numa_allocations.size(); node++) {
+            out << "file_cache_numa_allocations_total{node=\"" << node
+                << "\"} " << stats.numa_allocations[node] << "\n";
+        }
+    }
+
+    out << "# HELP file_cache_latency_seconds Latency of cache operations.\n";
+    out << "# TYPE file_cache_latency_seconds histogram\n";
+    prometheus_histogram(out, "pin", latency.pin);
+    prometheus_histogram(out, "fill", latency.fill);
+    prometheus_histogram(out, "write_back", latency.write_back);
+    prometheus_histogram(out, "unpin", latency.unpin);
+    prometheus_histogram(out, "decompress", latency.decompress);
+    return out.str();
+}
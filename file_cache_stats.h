@@ -0,0 +1,218 @@
+
+#ifndef _FILE_CACHE_STATS_H_
+#define _FILE_CACHE_STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* Point-in-time view of the cache counters returned by
+ * FileCacheImpl::GetStats(). The event counters are cumulative since the
+ * cache was constructed, the *_entries fields are current gauges.
+ */
+struct FileCacheStats {
+    FileCacheStats() : hits(0), misses(0), clean_evictions(0),
+                       dirty_evictions(0), write_backs(0),
+                       write_back_bytes(0), skipped_write_backs(0),
+                       skipped_write_back_bytes(0), syncs(0),
+                       wal_bytes(0), wal_checkpoints(0),
+                       wal_recovered_batches(0), prefetches(0),
+                       l2_hits(0), l2_admissions(0), l2_rejections(0),
+                       compressions(0), compressed_hits(0),
+                       compress_in_bytes(0), compress_out_bytes(0),
+                       zero_page_loads(0), copy_on_writes(0),
+                       dedup_hits(0), snapshot_publishes(0),
+                       txn_commits(0), txn_aborts(0),
+                       range_block_loads(0), range_block_evictions(0),
+                       lazy_faults(0), lazy_pages(0), front_cache_hits(0),
+                       io_errors(0), wait_ns(0),
+                       pinned_entries(0), dirty_entries(0),
+                       resident_entries(0), compressed_entries(0),
+                       compressed_bytes(0), dedup_saved_bytes(0),
+                       snapshot_versions(0), range_bytes(0)
+    {}
+    uint64_t hits;              //PinFiles requests found in the cache
+    uint64_t misses;            //PinFiles requests read from storage
+    uint64_t clean_evictions;
+    uint64_t dirty_evictions;   //evictions that needed a write-back
+    uint64_t write_backs;       //dirty buffers written to storage
+    uint64_t write_back_bytes;
+    uint64_t skipped_write_backs;      //dirty entries found unchanged
+    uint64_t skipped_write_back_bytes; //dirty pages found unchanged
+    uint64_t syncs;             //fdatasync() and directory fsync() calls
+    uint64_t wal_bytes;         //page bytes appended to the write-ahead log
+    uint64_t wal_checkpoints;
+    uint64_t wal_recovered_batches;
+    uint64_t prefetches;        //entries loaded from the warm restart index
+    uint64_t l2_hits;           //misses served from the L2 tier
+    uint64_t l2_admissions;     //evictions written to the L2 tier
+    uint64_t l2_rejections;     //evictions turned away by admission control
+    uint64_t compressions;      //entries moved to the compressed pool
+    uint64_t compressed_hits;   //misses served from the compressed pool
+    uint64_t compress_in_bytes; //compress_in_bytes / compress_out_bytes
+    uint64_t compress_out_bytes;//is the compression ratio
+    uint64_t zero_page_loads;   //all zero files put on the shared zero page
+    uint64_t copy_on_writes;    //private buffers made for their first write
+    uint64_t dedup_hits;        //loads that shared an identical buffer
+    uint64_t snapshot_publishes;//write sessions made visible to readers
+    uint64_t txn_commits;
+    uint64_t txn_aborts;
+    uint64_t range_block_loads;     //blocks read for PinRange()
+    uint64_t range_block_evictions;
+    uint64_t lazy_faults;       //first touches of lazily loaded pages
+    uint64_t lazy_pages;        //pages they filled, with readahead
+    uint64_t front_cache_hits;  //FileData() calls served without the lock
+    uint64_t io_errors;         //failed open/read/write calls
+    uint64_t wait_ns;           //total time spent blocked in PinFiles
+    int64_t pinned_entries;
+    int64_t dirty_entries;
+    int64_t resident_entries;
+    int64_t compressed_entries;
+    int64_t compressed_bytes;
+    int64_t dedup_saved_bytes;  //buffer memory not allocated thanks to dedup
+    int64_t snapshot_versions;  //replaced versions readers may still see
+    int64_t range_bytes;        //block memory held for PinRange()
+    //With FileCacheOptions::numa_placement, per node: pool buffers in use
+    //and allocated so far
+    std::vector<int64_t> numa_buffers;
+    std::vector<uint64_t> numa_allocations;
+};
+
+/* FileCacheCounters
+ * Event counters sharded across cache lines. Each thread adds to its own
+ * shard with relaxed atomics so the hot paths never share a line, readers
+ * sum all the shards. Nothing here needs the cache mutex.
+ */
+class FileCacheCounters {
+public:
+    enum Counter {
+        kHits,
+        kMisses,
+        kCleanEvictions,
+        kDirtyEvictions,
+        kWriteBacks,
+        kWriteBackBytes,
+        kSkippedWriteBacks,
+        kSkippedWriteBackBytes,
+        kSyncs,
+        kWalBytes,
+        kWalCheckpoints,
+        kWalRecoveredBatches,
+        kPrefetches,
+        kL2Hits,
+        kL2Admissions,
+        kL2Rejections,
+        kCompressions,
+        kCompressedHits,
+        kCompressInBytes,
+        kCompressOutBytes,
+        kZeroPageLoads,
+        kCopyOnWrites,
+        kDedupHits,
+        kSnapshotPublishes,
+        kTxnCommits,
+        kTxnAborts,
+        kRangeBlockLoads,
+        kRangeBlockEvictions,
+        kFrontCacheHits,
+        kIoErrors,
+        kWaitNs,
+        kNumCounters
+    };
+
+    FileCacheCounters();
+    void Add(Counter counter, uint64_t n = 1)
+    {
+        shards_[shard_index()].v_[counter].fetch_add(n,
+                std::memory_order_relaxed);
+    }
+    uint64_t Sum(Counter counter) const;
+
+private:
+    static const int kNumShards = 16;
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> v_[kNumCounters];
+    };
+    Shard shards_[kNumShards];
+
+    static int shard_index();
+};
+
+/* Copy of a FileCacheHistogram. Bucket b covers the nanosecond values
+ * [BucketLowerBound(b), BucketLowerBound(b + 1)).
+ */
+struct FileCacheHistogramSnapshot {
+    FileCacheHistogramSnapshot() : count(0), sum_ns(0), max_ns(0) {}
+    std::vector<uint64_t> counts;
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+
+    // Upper bound of the bucket holding quantile 'q' (0.0 - 1.0), or 0 if
+    // nothing was recorded.
+    uint64_t Percentile(double q) const;
+    uint64_t Mean() const { return count ? sum_ns / count : 0; }
+};
+
+/* FileCacheHistogram
+ * HDR-style latency histogram: values below 2^(kSubBucketBits + 1) ns get
+ * a bucket each, above that every power of two is split into
+ * 2^kSubBucketBits linear sub-buckets, so the relative error stays under
+ * 1/16 from nanoseconds up to 2^kMaxExponent ns (about 18 minutes). Larger
+ * values land in the last bucket. Record() is a few relaxed atomics.
+ */
+class FileCacheHistogram {
+public:
+    static const int kSubBucketBits = 4;
+    static const int kSubBuckets = 1 << kSubBucketBits;
+    static const int kMaxExponent = 40;
+    static const int kNumBuckets =
+        (kMaxExponent - kSubBucketBits + 1) * kSubBuckets;
+
+    FileCacheHistogram();
+    void Record(uint64_t ns);
+    FileCacheHistogramSnapshot Snapshot(bool reset);
+
+    static int BucketIndex(uint64_t ns);
+    static uint64_t BucketLowerBound(int bucket);
+
+private:
+    std::atomic<uint64_t> counts_[kNumBuckets];
+    std::atomic<uint64_t> sum_ns_;
+    std::atomic<uint64_t> max_ns_;
+};
+
+/* Records the lifetime of the object into a histogram. */
+class FileCacheLatencyTimer {
+public:
+    explicit FileCacheLatencyTimer(FileCacheHistogram& hist) :
+        hist_(hist), start_(std::chrono::steady_clock::now())
+    {}
+    ~FileCacheLatencyTimer()
+    {
+        hist_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count());
+    }
+private:
+    FileCacheHistogram& hist_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/* Latency snapshots returned by FileCacheImpl::GetLatency(). */
+struct FileCacheLatency {
+    FileCacheHistogramSnapshot pin;         //whole PinFiles() call
+    FileCacheHistogramSnapshot fill;        //open + read of a missed file
+    FileCacheHistogramSnapshot write_back;  //write of one dirty buffer
+    FileCacheHistogramSnapshot unpin;       //whole UnpinFiles() call
+    FileCacheHistogramSnapshot decompress;  //compressed pool hit
+};
+
+// Renders the counters and latency histograms in the Prometheus text
+// exposition format. Latencies are exported in seconds with power of two
+// bucket boundaries from 1us to about a minute.
+std::string FileCachePrometheusText(const FileCacheStats& stats,
+                                    const FileCacheLatency& latency);
+
+#endif // _FILE_CACHE_STATS_H_
@@ -0,0 +1,292 @@
+#include "file_cache_trace.h"
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static void
+put_varint(std::string& out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static bool
+get_varint(const std::string& in, size_t& pos, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+        uint8_t byte = in[pos++];
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::atomic<uint64_t> next_tracer_serial(1);
+
+FileCacheTracer::FileCacheTracer(const std::string& path) :
+    serial_(next_tracer_serial.fetch_add(1)),
+    start_(std::chrono::steady_clock::now())
+{
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd_ < 0) {
+        std::ostringstream err_str;
+        err_str << "Error opening trace file " << path
+                << " : " << strerror(errno);
+        throw std::runtime_error(err_str.str());
+    }
+    write_record(FILE_CACHE_TRACE_MAGIC);
+}
+
+FileCacheTracer::~FileCacheTracer()
+{
+    Flush();
+    for (auto& b : buffers_) {
+        delete b.second;
+    }
+    ::close(fd_);
+}
+
+void
+FileCacheTracer::Record(FileCacheTraceOp op,
+                        const std::vector<std::string>& names)
+{
+    ThreadBuffer *buf = thread_buffer();
+    std::lock_guard<std::mutex> lock(buf->m_);
+    append_event(buf, op, names.data(), names.size());
+}
+
+void
+FileCacheTracer::Record(FileCacheTraceOp op, const std::string& name)
+{
+    ThreadBuffer *buf = thread_buffer();
+    std::lock_guard<std::mutex> lock(buf->m_);
+    append_event(buf, op, &name, 1);
+}
+
+void
+FileCacheTracer::Flush()
+{
+    std::vector<ThreadBuffer *> buffers;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        for (auto& b : buffers_) {
+            buffers.push_back(b.second);
+        }
+    }
+    for (auto buf : buffers) {
+        std::lock_guard<std::mutex> lock(buf->m_);
+        flush_buffer(buf);
+    }
+}
+
+/*thread_buffer
+ * Output: the calling thread's buffer, created on first use. The last
+ * tracer/buffer pair is remembered in a thread local so the common case
+ * takes no lock.
+ */
+FileCacheTracer::ThreadBuffer *
+FileCacheTracer::thread_buffer()
+{
+    static thread_local uint64_t cached_serial = 0;
+    static thread_local ThreadBuffer *cached_buf = nullptr;
+    if (cached_serial == serial_) {
+        return cached_buf;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    ThreadBuffer *&buf = buffers_[std::this_thread::get_id()];
+    if (buf == nullptr) {
+        buf = new ThreadBuffer(buffers_.size() - 1);
+    }
+    cached_serial = serial_;
+    cached_buf = buf;
+    return buf;
+}
+
+/*intern
+ * Input: thread buffer (locked by the caller) and a file name
+ * Output: id of the name. New names are written to the trace right away
+ *         so their definition precedes every chunk that refers to them.
+ */
+uint32_t
+FileCacheTracer::intern(ThreadBuffer *buf, const std::string& name)
+{
+    auto litr = buf->name_ids_.find(name);
+    if (litr != buf->name_ids_.end()) {
+        return litr->second;
+    }
+    uint32_t id;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        auto gitr = name_ids_.find(name);
+        if (gitr != name_ids_.end()) {
+            id = gitr->second;
+        } else {
+            id = name_ids_.size();
+            name_ids_.insert(std::make_pair(name, id));
+            std::string record(1, 'N');
+            put_varint(record, id);
+            put_varint(record, name.size());
+            record += name;
+            write_record(record);
+        }
+    }
+    buf->name_ids_.insert(std::make_pair(name, id));
+    return id;
+}
+
+void
+FileCacheTracer::append_event(ThreadBuffer *buf, FileCacheTraceOp op,
+                              const std::string *names, size_t count)
+{
+    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+    if (buf->events_.empty()) {
+        buf->base_ns_ = buf->last_ns_ = now_ns;
+    }
+    buf->events_.push_back((char)op);
+    put_varint(buf->events_, now_ns - buf->last_ns_);
+    buf->last_ns_ = now_ns;
+    put_varint(buf->events_, count);
+    for (size_t i = 0; i < count; i++) {
+        put_varint(buf->events_, intern(buf, names[i]));
+    }
+    if (buf->events_.size() >= kBufferSize) {
+        flush_buffer(buf);
+    }
+}
+
+void
+FileCacheTracer::flush_buffer(ThreadBuffer *buf)
+{
+    if (buf->events_.empty()) {
+        return;
+    }
+    std::string record(1, 'C');
+    put_varint(record, buf->thread_id_);
+    put_varint(record, buf->base_ns_);
+    put_varint(record, buf->events_.size());
+    record += buf->events_;
+    write_record(record);
+    buf->events_.clear();
+}
+
+void
+FileCacheTracer::write_record(const std::string& record)
+{
+    std::lock_guard<std::mutex> lock(file_m_);
+    size_t done = 0;
+    while (done < record.size()) {
+        ssize_t nbytes = ::write(fd_, record.data() + done,
+                                 record.size() - done);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error writing trace : %s\n", strerror(errno));
+            return;
+        }
+        done += nbytes;
+    }
+}
+
+static void
+trace_error(const std::string& path, const char *what)
+{
+    std::ostringstream err_str;
+    err_str << "Malformed trace file " << path << " : " << what;
+    throw std::runtime_error(err_str.str());
+}
+
+FileCacheTrace
+ReadFileCacheTrace(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::ostringstream err_str;
+        err_str << "Error opening trace file " << path
+                << " : " << strerror(errno);
+        throw std::runtime_error(err_str.str());
+    }
+    std::string data;
+    char chunk[64 * 1024];
+    ssize_t nbytes;
+    while ((nbytes = ::read(fd, chunk, sizeof(chunk))) > 0) {
+        data.append(chunk, nbytes);
+    }
+    ::close(fd);
+    size_t magic_len = strlen(FILE_CACHE_TRACE_MAGIC);
+    if (nbytes < 0 || data.compare(0, magic_len, FILE_CACHE_TRACE_MAGIC) != 0) {
+        trace_error(path, "bad magic");
+    }
+
+    FileCacheTrace trace;
+    trace.num_threads = 0;
+    size_t pos = magic_len;
+    while (pos < data.size()) {
+        char tag = data[pos++];
+        uint64_t a, b, len;
+        if (!get_varint(data, pos, a) || !get_varint(data, pos, b)) {
+            trace_error(path, "truncated record");
+        }
+        if (tag == 'N') {
+            //a = id, b = length
+            if (pos + b > data.size()) {
+                trace_error(path, "truncated name");
+            }
+            if (trace.names.size() <= a) {
+                trace.names.resize(a + 1);
+            }
+            trace.names[a] = data.substr(pos, b);
+            pos += b;
+        } else if (tag == 'C') {
+            //a = thread, b = base timestamp
+            if (!get_varint(data, pos, len) || pos + len > data.size()) {
+                trace_error(path, "truncated chunk");
+            }
+            size_t end = pos + len;
+            uint64_t ts = b;
+            while (pos < end) {
+                FileCacheTraceEvent event;
+                uint64_t delta, count, id;
+                event.op = (FileCacheTraceOp)(uint8_t)data[pos++];
+                if (!get_varint(data, pos, delta) ||
+                    !get_varint(data, pos, count)) {
+                    trace_error(path, "truncated event");
+                }
+                ts += delta;
+                event.ts_ns = ts;
+                event.thread_id = a;
+                for (uint64_t i = 0; i < count; i++) {
+                    if (!get_varint(data, pos, id) || id >= trace.names.size()) {
+                        trace_error(path, "bad name id");
+                    }
+                    event.names.push_back(id);
+                }
+                trace.events.push_back(event);
+            }
+            if (pos != end) {
+                trace_error(path, "chunk overrun");
+            }
+            trace.num_threads = std::max<uint32_t>(trace.num_threads, a + 1);
+        } else {
+            trace_error(path, "unknown record");
+        }
+    }
+    std::stable_sort(trace.events.begin(), trace.events.end(),
+                     [](const FileCacheTraceEvent& x,
+                        const FileCacheTraceEvent& y) {
+                         return x.ts_ns < y.ts_ns;
+                     });
+    return trace;
+}
@@ -0,0 +1,106 @@
+
+#ifndef _FILE_CACHE_TRACE_H_
+#define _FILE_CACHE_TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+/* Trace file layout. After the 8 byte magic the file is a sequence of
+ * records, each starting with a one byte tag:
+ *
+ *   'N' varint id, varint length, name bytes
+ *       Interns a file name. Always written before the first chunk that
+ *       uses the id.
+ *   'C' varint thread, varint base timestamp (ns), varint length, events
+ *       One flushed per-thread buffer. Each event is a one byte op, a
+ *       varint timestamp delta from the previous event in the chunk (the
+ *       first one from the base), a varint name count and the name ids.
+ *
+ * Chunks of different threads interleave, readers merge them by time.
+ */
+#define FILE_CACHE_TRACE_MAGIC "FCTRACE1"
+
+enum FileCacheTraceOp {
+    kTracePin = 1,
+    kTraceUnpin = 2,
+    kTraceFileData = 3,
+    kTraceMutableFileData = 4,
+    kTraceFlush = 5,            //no names means FlushAll()
+    kTracePinRead = 6,
+    kTraceUnpinRead = 7
+};
+
+/* FileCacheTracer
+ * Appends API calls to a trace file. Each thread records into its own
+ * buffer, which is written out as one chunk when it fills up, on Flush()
+ * and on destruction. Names are interned once per tracer.
+ */
+class FileCacheTracer {
+public:
+    // Throws std::runtime_error if 'path' cannot be created.
+    explicit FileCacheTracer(const std::string& path);
+    ~FileCacheTracer();
+    void Record(FileCacheTraceOp op, const std::vector<std::string>& names);
+    void Record(FileCacheTraceOp op, const std::string& name);
+    void Flush();
+
+private:
+    static const size_t kBufferSize = 64 * 1024;
+    struct ThreadBuffer {
+        ThreadBuffer(uint32_t thread_id) : thread_id_(thread_id),
+                                           base_ns_(0), last_ns_(0)
+        {}
+        std::mutex m_;
+        uint32_t thread_id_;
+        uint64_t base_ns_;
+        uint64_t last_ns_;
+        std::string events_;
+        //Names this thread already resolved, to skip the shared table
+        std::unordered_map<std::string, uint32_t> name_ids_;
+    };
+
+    int fd_;
+    uint64_t serial_;
+    std::chrono::steady_clock::time_point start_;
+    //Protects the shared name table and buffers_. Taken after a
+    //ThreadBuffer::m_, never before one.
+    std::mutex m_;
+    //Serializes appends to fd_, always taken last
+    std::mutex file_m_;
+    std::unordered_map<std::string, uint32_t> name_ids_;
+    std::map<std::thread::id, ThreadBuffer*> buffers_;
+
+    ThreadBuffer *thread_buffer();
+    uint32_t intern(ThreadBuffer *buf, const std::string& name);
+    void append_event(ThreadBuffer *buf, FileCacheTraceOp op,
+                      const std::string *names, size_t count);
+    void flush_buffer(ThreadBuffer *buf);
+    void write_record(const std::string& record);
+};
+
+struct FileCacheTraceEvent {
+    uint64_t ts_ns;
+    uint32_t thread_id;
+    FileCacheTraceOp op;
+    std::vector<uint32_t> names;
+};
+
+/* Whole trace loaded in memory, events sorted by timestamp. */
+struct FileCacheTrace {
+    std::vector<std::string> names;
+    std::vector<FileCacheTraceEvent> events;
+    uint32_t num_threads;
+};
+
+// Loads a trace written by FileCacheTracer. Throws std::runtime_error if
+// the file cannot be read or is malformed.
+FileCacheTrace ReadFileCacheTrace(const std::string& path);
+
+#endif // _FILE_CACHE_TRACE_H_
@@ -0,0 +1,253 @@
+#include "file_cache_wal.h"
+#include "file_cache_simd.h"
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <sstream>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const uint32_t kBatchTag = 'B';
+static const size_t kBatchHeader = 16;
+
+static void
+put_u32(std::string& out, uint32_t v)
+{
+    out.append((const char *)&v, sizeof(v));
+}
+
+static bool
+get_u32(const std::string& in, size_t& pos, size_t end, uint32_t& v)
+{
+    if (pos + sizeof(v) > end) {
+        return false;
+    }
+    memcpy(&v, in.data() + pos, sizeof(v));
+    pos += sizeof(v);
+    return true;
+}
+
+static void
+wal_error(const std::string& what, const std::string& path)
+{
+    std::ostringstream err_str;
+    err_str << what << " " << path << " : " << strerror(errno);
+    throw std::runtime_error(err_str.str());
+}
+
+static bool
+write_all(int fd, const char *data, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t nbytes = ::pwrite(fd, data, len, offset);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += nbytes;
+        len -= nbytes;
+        offset += nbytes;
+    }
+    return true;
+}
+
+FileCacheWal::FileCacheWal(const std::string& path) : path_(path),
+                                                      syncing_(false)
+{
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd_ < 0) {
+        wal_error("Error opening log", path);
+    }
+    size_t magic_len = strlen(FILE_CACHE_WAL_MAGIC);
+    if (!write_all(fd_, FILE_CACHE_WAL_MAGIC, magic_len, 0) ||
+        ::fdatasync(fd_) < 0) {
+        ::close(fd_);
+        wal_error("Error writing log", path);
+    }
+    size_ = synced_ = magic_len;
+}
+
+FileCacheWal::~FileCacheWal()
+{
+    ::close(fd_);
+}
+
+uint64_t
+FileCacheWal::Append(const std::vector<FileCacheWalRecord>& records)
+{
+    std::string batch(kBatchHeader, '\0');
+    put_u32(batch, records.size());
+    for (const auto& record : records) {
+        put_u32(batch, record.name->size());
+        batch += *record.name;
+        put_u32(batch, record.offset);
+        put_u32(batch, record.len);
+        batch.append(record.data, record.len);
+    }
+    uint32_t tag = kBatchTag;
+    uint32_t payload_len = batch.size() - kBatchHeader;
+    uint64_t checksum = FileCacheHash64(batch.data() + kBatchHeader,
+                                        payload_len);
+    memcpy(&batch[0], &tag, sizeof(tag));
+    memcpy(&batch[4], &payload_len, sizeof(payload_len));
+    memcpy(&batch[8], &checksum, sizeof(checksum));
+
+    std::lock_guard<std::mutex> lock(m_);
+    if (!write_all(fd_, batch.data(), batch.size(), size_)) {
+        std::ostringstream err_str;
+        err_str << "Error writing log " << path_ << " : " << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        return 0;
+    }
+    size_ += batch.size();
+    return size_;
+}
+
+bool
+FileCacheWal::Sync(uint64_t lsn)
+{
+    std::unique_lock<std::mutex> lock(m_);
+    while (synced_ < lsn && synced_ < size_) {
+        if (syncing_) {
+            //Someone else's sync may cover us, check again when it's done
+            cv_.wait(lock);
+            continue;
+        }
+        syncing_ = true;
+        uint64_t target = size_;
+        lock.unlock();
+        int ret = ::fdatasync(fd_);
+        lock.lock();
+        syncing_ = false;
+        cv_.notify_all();
+        if (ret < 0) {
+            std::ostringstream err_str;
+            err_str << "Error syncing log " << path_ << " : "
+                    << strerror(errno);
+            fprintf(stderr, "%s\n", err_str.str().c_str());
+            return false;
+        }
+        synced_ = target;
+    }
+    return true;
+}
+
+bool
+FileCacheWal::Truncate()
+{
+    std::unique_lock<std::mutex> lock(m_);
+    while (syncing_) {
+        cv_.wait(lock);
+    }
+    size_t magic_len = strlen(FILE_CACHE_WAL_MAGIC);
+    if (::ftruncate(fd_, magic_len) < 0 || ::fdatasync(fd_) < 0) {
+        std::ostringstream err_str;
+        err_str << "Error truncating log " << path_ << " : "
+                << strerror(errno);
+        fprintf(stderr, "%s\n", err_str.str().c_str());
+        return false;
+    }
+    size_ = synced_ = magic_len;
+    return true;
+}
+
+uint64_t
+FileCacheWal::Size()
+{
+    std::lock_guard<std::mutex> lock(m_);
+    return size_;
+}
+
+uint64_t
+FileCacheWal::Recover(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        wal_error("Error opening log", path);
+    }
+    std::string data;
+    char chunk[64 * 1024];
+    ssize_t nbytes;
+    while ((nbytes = ::read(fd, chunk, sizeof(chunk))) > 0) {
+        data.append(chunk, nbytes);
+    }
+    ::close(fd);
+    if (nbytes < 0) {
+        wal_error("Error reading log", path);
+    }
+    size_t magic_len = strlen(FILE_CACHE_WAL_MAGIC);
+    if (data.compare(0, magic_len, FILE_CACHE_WAL_MAGIC) != 0) {
+        //Crashed before the header made it out, nothing was logged
+        return 0;
+    }
+
+    std::map<std::string, int> files;
+    std::set<std::string> dirs;
+    uint64_t batches = 0;
+    size_t pos = magic_len;
+    bool failed = false;
+    while (!failed && pos + kBatchHeader <= data.size()) {
+        uint32_t tag, payload_len;
+        uint64_t checksum;
+        memcpy(&tag, data.data() + pos, sizeof(tag));
+        memcpy(&payload_len, data.data() + pos + 4, sizeof(payload_len));
+        memcpy(&checksum, data.data() + pos + 8, sizeof(checksum));
+        size_t start = pos + kBatchHeader;
+        size_t end = start + payload_len;
+        if (tag != kBatchTag || end > data.size() ||
+            FileCacheHash64(data.data() + start, payload_len) != checksum) {
+            //Torn tail of the log
+            break;
+        }
+        pos = start;
+        uint32_t count;
+        get_u32(data, pos, end, count);
+        for (uint32_t i = 0; i < count && !failed; i++) {
+            uint32_t name_len, offset, len;
+            get_u32(data, pos, end, name_len);
+            std::string name = data.substr(pos, name_len);
+            pos += name_len;
+            get_u32(data, pos, end, offset);
+            get_u32(data, pos, end, len);
+            auto fitr = files.find(name);
+            if (fitr == files.end()) {
+                int new_fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0777);
+                fitr = files.insert(std::make_pair(name, new_fd)).first;
+                size_t slash = name.find_last_of('/');
+                dirs.insert(slash == std::string::npos ? "." :
+                            slash == 0 ? "/" : name.substr(0, slash));
+            }
+            int file_fd = fitr->second;
+            failed = (file_fd < 0 ||
+                      !write_all(file_fd, data.data() + pos, len, offset));
+            pos += len;
+        }
+        pos = end;
+        batches++;
+    }
+    for (const auto& file : files) {
+        if (file.second >= 0) {
+            failed = failed || ::fdatasync(file.second) < 0;
+            ::close(file.second);
+        }
+    }
+    for (const auto& dir : dirs) {
+        int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        failed = failed || dir_fd < 0 || ::fsync(dir_fd) < 0;
+        if (dir_fd >= 0) {
+            ::close(dir_fd);
+        }
+    }
+    if (failed) {
+        wal_error("Error applying log", path);
+    }
+    return batches;
+}
@@ -0,0 +1,69 @@
+
+#ifndef _FILE_CACHE_WAL_H_
+#define _FILE_CACHE_WAL_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* WAL file layout. After the 8 byte magic the log is a sequence of
+ * batches, each applied all or nothing by recovery:
+ *
+ *   u32 'B', u32 payload length, u64 FileCacheHash64 of the payload
+ *   payload: u32 record count, then per record
+ *            u32 name length, name bytes, u32 file offset, u32 length,
+ *            data bytes
+ *
+ * Integers are in host byte order, the log is not meant to move between
+ * machines. A batch that is cut short or fails its checksum ends the log.
+ */
+#define FILE_CACHE_WAL_MAGIC "FCWAL001"
+
+/* One extent of new file contents to log */
+struct FileCacheWalRecord {
+    const std::string *name;
+    uint32_t offset;
+    const char *data;
+    uint32_t len;
+};
+
+/* FileCacheWal
+ * Append-only redo log. Append() writes a batch at the end of the log
+ * without syncing; Sync() makes everything up to an LSN durable, and
+ * callers that arrive while a sync is running wait for it and share the
+ * next one (group commit). LSNs are byte offsets of batch ends.
+ */
+class FileCacheWal {
+public:
+    // Creates an empty log at 'path', replacing whatever is there, so
+    // Recover() must have been run first. Throws std::runtime_error.
+    explicit FileCacheWal(const std::string& path);
+    ~FileCacheWal();
+
+    // Returns the LSN of the batch, or 0 if the write failed.
+    uint64_t Append(const std::vector<FileCacheWalRecord>& records);
+    bool Sync(uint64_t lsn);
+    // Empties the log. Only valid once every logged batch has been
+    // written in place and synced.
+    bool Truncate();
+    uint64_t Size();
+
+    // Writes the complete batches of the log at 'path' to their files
+    // and syncs them. A missing log is not an error. Returns the number
+    // of batches applied, throws std::runtime_error if the log can't be
+    // read or a file can't be written.
+    static uint64_t Recover(const std::string& path);
+
+private:
+    std::string path_;
+    int fd_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    uint64_t size_;     //end of the last appended batch
+    uint64_t synced_;   //everything before this is on storage
+    bool syncing_;
+};
+
+#endif // _FILE_CACHE_WAL_H_
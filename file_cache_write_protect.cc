@@ -0,0 +1,203 @@
+#include "file_cache_write_protect.h"
+#include <mutex>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t kSlots = 1 << 16;
+
+//Region::base values that are not buffer addresses
+const uintptr_t kEmpty = 0;
+const uintptr_t kDeleted = 1;
+const uintptr_t kClaimed = 2;
+
+struct Region {
+    std::atomic<uintptr_t> base;
+    std::atomic<size_t> len;
+    std::atomic<size_t> page_size;
+    std::atomic<std::atomic<uint64_t> *> dirty_pages;
+};
+
+//Static storage, so every slot starts out zero (kEmpty)
+Region regions[kSlots];
+std::atomic<size_t> max_buffer_pages;
+std::atomic<uint64_t> faults;
+struct sigaction old_action;
+size_t sys_page_size;
+std::once_flag page_size_once;
+std::once_flag handler_once;
+
+void
+init_page_size()
+{
+    sys_page_size = sysconf(_SC_PAGESIZE);
+}
+
+size_t
+slot_of(uintptr_t base)
+{
+    return ((base / sys_page_size) * 0x9e3779b97f4a7c15ULL) >> 48;
+}
+
+size_t
+round_to_pages(size_t len)
+{
+    return (len + sys_page_size - 1) & ~(sys_page_size - 1);
+}
+
+Region *
+find_region(uintptr_t base)
+{
+    size_t slot = slot_of(base);
+    for (size_t probe = 0; probe < kSlots; probe++) {
+        Region& r = regions[(slot + probe) & (kSlots - 1)];
+        uintptr_t b = r.base.load(std::memory_order_acquire);
+        if (b == base) {
+            return &r;
+        }
+        if (b == kEmpty) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+void
+chain_to_old_handler(int sig, siginfo_t *info, void *context)
+{
+    if (old_action.sa_flags & SA_SIGINFO) {
+        old_action.sa_sigaction(sig, info, context);
+    } else if (old_action.sa_handler == SIG_DFL ||
+               old_action.sa_handler == SIG_IGN) {
+        //Restore the default action, the faulting store re-executes and
+        //terminates the process as it would have without us
+        signal(sig, SIG_DFL);
+    } else {
+        old_action.sa_handler(sig);
+    }
+}
+
+void
+fault_handler(int sig, siginfo_t *info, void *context)
+{
+    if (info->si_code == SEGV_ACCERR) {
+        uintptr_t addr = (uintptr_t)info->si_addr;
+        uintptr_t page = addr & ~(uintptr_t)(sys_page_size - 1);
+        size_t max_pages = max_buffer_pages.load(std::memory_order_relaxed);
+        //Buffers start on a page boundary at or below the faulting page
+        for (size_t back = 0; back < max_pages && back * sys_page_size <= page;
+             back++) {
+            uintptr_t base = page - back * sys_page_size;
+            Region *r = find_region(base);
+            if (r == nullptr) {
+                continue;
+            }
+            size_t len = r->len.load(std::memory_order_relaxed);
+            if (addr >= base + len) {
+                break;
+            }
+            size_t unit = r->page_size.load(std::memory_order_relaxed);
+            uintptr_t end = page + sys_page_size < base + len ?
+                page + sys_page_size : base + len;
+            uint64_t bits = 0;
+            for (size_t bit = (page - base) / unit;
+                 bit <= (end - 1 - base) / unit; bit++) {
+                bits |= (uint64_t)1 << bit;
+            }
+            r->dirty_pages.load(std::memory_order_relaxed)->fetch_or(bits);
+            faults.fetch_add(1, std::memory_order_relaxed);
+            mprotect((void *)page, sys_page_size, PROT_READ | PROT_WRITE);
+            return;
+        }
+    }
+    chain_to_old_handler(sig, info, context);
+}
+
+void
+install_handler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &old_action) < 0) {
+        fprintf(stderr, "Error installing SIGSEGV handler : %s\n",
+                strerror(errno));
+    }
+}
+
+} // namespace
+
+char *
+FileCacheWriteProtect::Allocate(size_t len)
+{
+    std::call_once(page_size_once, init_page_size);
+    void *buf = mmap(nullptr, round_to_pages(len), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return buf == MAP_FAILED ? nullptr : (char *)buf;
+}
+
+void
+FileCacheWriteProtect::Free(char *buf, size_t len)
+{
+    munmap(buf, round_to_pages(len));
+}
+
+bool
+FileCacheWriteProtect::Register(char *buf, size_t len, size_t page_size,
+                                std::atomic<uint64_t> *dirty_pages)
+{
+    std::call_once(page_size_once, init_page_size);
+    std::call_once(handler_once, install_handler);
+    size_t pages = round_to_pages(len) / sys_page_size;
+    size_t max_pages = max_buffer_pages.load();
+    while (pages > max_pages &&
+           !max_buffer_pages.compare_exchange_weak(max_pages, pages)) {
+    }
+    uintptr_t base = (uintptr_t)buf;
+    size_t slot = slot_of(base);
+    for (size_t probe = 0; probe < kSlots; probe++) {
+        Region& r = regions[(slot + probe) & (kSlots - 1)];
+        uintptr_t b = r.base.load(std::memory_order_relaxed);
+        if ((b == kEmpty || b == kDeleted) &&
+            r.base.compare_exchange_strong(b, kClaimed)) {
+            r.len.store(len, std::memory_order_relaxed);
+            r.page_size.store(page_size, std::memory_order_relaxed);
+            r.dirty_pages.store(dirty_pages, std::memory_order_relaxed);
+            r.base.store(base, std::memory_order_release);
+            Protect(buf, len);
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+FileCacheWriteProtect::Unregister(char *buf)
+{
+    Region *r = find_region((uintptr_t)buf);
+    if (r != nullptr) {
+        r->base.store(kDeleted, std::memory_order_release);
+    }
+}
+
+void
+FileCacheWriteProtect::Protect(char *buf, size_t len)
+{
+    if (mprotect(buf, round_to_pages(len), PROT_READ) < 0) {
+        fprintf(stderr, "Error write protecting buffer : %s\n",
+                strerror(errno));
+    }
+}
+
+uint64_t
+FileCacheWriteProtect::Faults()
+{
+    return faults.load(std::memory_order_relaxed);
+}
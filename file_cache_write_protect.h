@@ -0,0 +1,41 @@
+
+#ifndef _FILE_CACHE_WRITE_PROTECT_H_
+#define _FILE_CACHE_WRITE_PROTECT_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/* FileCacheWriteProtect
+ * Write detection for cache buffers. A registered buffer is mapped
+ * read-only; the first store to each of its pages raises SIGSEGV, which
+ * the handler installed here resolves by setting the page's bit in the
+ * buffer's dirty bitmap (one bit per 'page_size' bytes given to
+ * Register()) and making that page writable again. Faults outside
+ * registered buffers are passed on to the previous SIGSEGV disposition.
+ *
+ * The registry is a fixed-size open addressed table so the handler never
+ * allocates or locks. When it is full Register() fails and the caller
+ * must fall back to treating the buffer as dirty on every write request.
+ */
+class FileCacheWriteProtect {
+public:
+    // Anonymous page-aligned mapping of at least 'len' bytes, read-write.
+    // Returns nullptr on failure.
+    static char *Allocate(size_t len);
+    static void Free(char *buf, size_t len);
+
+    // Starts tracking 'buf' (from Allocate()) and maps it read-only.
+    static bool Register(char *buf, size_t len, size_t page_size,
+                         std::atomic<uint64_t> *dirty_pages);
+    static void Unregister(char *buf);
+
+    // Maps all of 'buf' read-only again, typically right after the dirty
+    // bits were collected for write-back.
+    static void Protect(char *buf, size_t len);
+
+    // Total faults resolved by the handler, across all caches
+    static uint64_t Faults();
+};
+
+#endif // _FILE_CACHE_WRITE_PROTECT_H_
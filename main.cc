@@ -25,7 +25,7 @@ const char* file4_data = "ghghghgh";
 
 
 void threadfunc(const std::map<std::string, std::string>& files_info,
-                 std::shared_ptr<FileCache> fc)
+                 std::shared_ptr<FileCacheImpl> fc)
 {
     
     std::vector<std::string> file_vec;
@@ -34,19 +34,48 @@ void threadfunc(const std::map<std::string, std::string>& files_info,
     }
     fc->PinFiles(file_vec);
     for (auto f : files_info) {
-        char *file_wbuf = fc->MutableFileData(f.first);
+        char *file_wbuf = fc->MutableFileRange(f.first, 0, f.second.size());
         strncpy(file_wbuf, f.second.c_str(), f.second.size());
     }   
     fc->UnpinFiles(file_vec);
     fc->PinFiles(file_vec);
     for (const auto& f : files_info) {
         const char *file_rbuf = fc->FileData(f.first);
-        assert(strncmp(file_rbuf, f.second.c_str(), f.second.size() + 1));
+        assert(strncmp(file_rbuf, f.second.c_str(), f.second.size() + 1) == 0);
     }
     fc->UnpinFiles(file_vec);
     return;
 }
 
+/*
+ * A thread that looked a file up through the front cache and then becomes
+ * one of its writers must see its own writes, not the published version
+ * it looked up.
+ */
+void front_cache_check()
+{
+    FileCacheOptions options;
+    options.snapshot_reads = true;
+    options.front_cache = true;
+    FileCacheImpl fc(2, options);
+    std::vector<std::string> file_vec(1, file1);
+    //Another writer already has a draft going
+    std::thread writer([&fc, &file_vec]() {
+        fc.PinFiles(file_vec);
+        fc.MutableFileRange(file1, 0, 1)[0] = 'w';
+    });
+    writer.join();
+    fc.PinFilesForRead(file_vec);
+    assert(fc.FileData(file1)[0] == file1_data[0]);
+    fc.UnpinFilesForRead(file_vec);
+    fc.PinFiles(file_vec);
+    fc.MutableFileRange(file1, 1, 1)[0] = 'x';
+    assert(strncmp(fc.FileData(file1), "wx", 2) == 0);
+    fc.UnpinFiles(file_vec);
+    fc.UnpinFiles(file_vec);
+    assert(strncmp(fc.FileData(file1), "wx", 2) == 0);
+}
+
 /*
  * S_IRUSR
  */
@@ -64,6 +93,19 @@ int main(int argc, char** argv) {
     std::thread t2(threadfunc, std::ref(file_map2), fc);
     t1.join();
     t2.join();
+    //Make what is still cached durable
+    if (!fc->FlushAll()) {
+        cout << "Flush failed" << endl;
+        return 1;
+    }
+    FileCacheStats stats = fc->GetStats();
+    fc.reset();
+    front_cache_check();
+    cout << "hits " << stats.hits << " misses " << stats.misses
+         << " evictions " << stats.clean_evictions + stats.dirty_evictions
+         << " (dirty " << stats.dirty_evictions << ")"
+         << " write-back bytes " << stats.write_back_bytes
+         << " syncs " << stats.syncs << endl;
     cout << "Finished successfully" << endl;
     return 0;
 }
@@ -0,0 +1,185 @@
+/*
+ * File:   replay.cc
+ *
+ * Replays a trace recorded with FileCacheOptions::trace_path against a
+ * fresh FileCacheImpl:
+ *
+ *   file_cache_replay [-c entries] [-m original|fast] [-T dir] [-R] trace
+ *
+ * Every traced thread gets a replay thread that issues its calls in the
+ * recorded order, either at the recorded offsets from the start of the
+ * trace or back to back. MutableFileData() calls mark entries dirty but
+ * leave the contents alone. By default names are remapped into a mkdtemp
+ * directory under -T; -R replays against the original paths.
+ *
+ * Calls of different threads only keep their recorded order in original
+ * mode, so a fast replay of a trace that ran close to the cache size may
+ * need a larger -c to avoid blocking forever.
+ */
+
+#include <cstdlib>
+#include "file_cache_impl.h"
+#include "tool_util.h"
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+static void
+replay_thread(FileCacheImpl& fc, const vector<const FileCacheTraceEvent *>& events,
+              const vector<string>& names, bool original_timing,
+              chrono::steady_clock::time_point start)
+{
+    vector<string> file_vec;
+    for (auto event : events) {
+        if (original_timing) {
+            this_thread::sleep_until(start + chrono::nanoseconds(event->ts_ns));
+        }
+        file_vec.clear();
+        for (auto id : event->names) {
+            file_vec.push_back(names[id]);
+        }
+        switch (event->op) {
+        case kTracePin:
+            fc.PinFiles(file_vec);
+            break;
+        case kTraceUnpin:
+            fc.UnpinFiles(file_vec);
+            break;
+        case kTracePinRead:
+            fc.PinFilesForRead(file_vec);
+            break;
+        case kTraceUnpinRead:
+            fc.UnpinFilesForRead(file_vec);
+            break;
+        case kTraceFileData:
+            fc.FileData(file_vec[0]);
+            break;
+        case kTraceMutableFileData:
+            fc.MutableFileData(file_vec[0]);
+            break;
+        case kTraceFlush:
+            if (file_vec.empty()) {
+                fc.FlushAll();
+            } else {
+                fc.Flush(file_vec);
+            }
+            break;
+        }
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    cerr << "usage: " << prog
+         << " [-c entries] [-m original|fast] [-T dir] [-R] trace" << endl;
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    int cache_entries = 100;
+    bool original_timing = false;
+    bool original_paths = false;
+    string parent;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:m:T:R")) != -1) {
+        switch (opt) {
+        case 'c':
+            cache_entries = atoi(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "original") == 0) {
+                original_timing = true;
+            } else if (strcmp(optarg, "fast") == 0) {
+                original_timing = false;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'T':
+            parent = optarg;
+            break;
+        case 'R':
+            original_paths = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || cache_entries < 1) {
+        usage(argv[0]);
+    }
+
+    FileCacheTrace trace;
+    try {
+        trace = ReadFileCacheTrace(argv[optind]);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    string dir;
+    vector<string> names = trace.names;
+    if (!original_paths) {
+        dir = MakeTempDir(parent, "file_cache_replay");
+        if (dir.empty()) {
+            return 1;
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            ostringstream name;
+            name << dir << "/t" << i;
+            names[i] = name.str();
+        }
+    }
+
+    vector<vector<const FileCacheTraceEvent *> > per_thread(trace.num_threads);
+    for (const auto& event : trace.events) {
+        per_thread[event.thread_id].push_back(&event);
+    }
+
+    double seconds;
+    FileCacheStats stats;
+    FileCacheLatency latency;
+    {
+        FileCacheImpl fc(cache_entries);
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (const auto& events : per_thread) {
+            workers.push_back(thread(replay_thread, ref(fc), cref(events),
+                                     cref(names), original_timing, start));
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        seconds = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+        stats = fc.GetStats();
+        latency = fc.GetLatency();
+    }
+
+    uint64_t lookups = stats.hits + stats.misses;
+    cout << "mode,threads,events,names,cache_entries,seconds,events_per_sec,"
+         << "hit_ratio,pin_p50_ns,pin_p99_ns,pin_p999_ns,dirty_evictions,"
+         << "clean_evictions,wait_ns" << endl;
+    cout << (original_timing ? "original" : "fast") << ","
+         << trace.num_threads << "," << trace.events.size() << ","
+         << trace.names.size() << "," << cache_entries << ","
+         << seconds << "," << trace.events.size() / seconds << ","
+         << (lookups ? (double)stats.hits / lookups : 0) << ","
+         << latency.pin.Percentile(0.50) << ","
+         << latency.pin.Percentile(0.99) << ","
+         << latency.pin.Percentile(0.999) << ","
+         << stats.dirty_evictions << "," << stats.clean_evictions << ","
+         << stats.wait_ns << endl;
+
+    if (!dir.empty()) {
+        RemoveTree(dir);
+    }
+    return 0;
+}
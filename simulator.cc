@@ -0,0 +1,309 @@
+/*
+ * File:   simulator.cc
+ *
+ * Offline what-if sizing for FileCacheImpl. Reads an access trace and
+ * prints the LRU miss ratio curve, i.e. the miss ratio for every cache
+ * size at once, as CSV:
+ *
+ *   file_cache_sim [-r rate] [-n points] [-x size,size,...] [-t] trace
+ *
+ * The trace is a FileCacheOptions::trace_path recording, where every file
+ * in a PinFiles() or PinFilesForRead() call counts as one access, or with
+ * -t a text file with one file name per line.
+ *
+ * The curve comes from Mattson stack distances computed with a Fenwick
+ * tree over access times, O(log n) per access. With -r below 1 the keys
+ * are spatially sampled as in SHARDS: a key is kept if its hash falls
+ * under rate * 2^24 and distances are scaled by 1 / rate, which keeps the
+ * memory and time proportional to the sample.
+ *
+ * FileCacheImpl itself evicts the first unpinned entry in file name order,
+ * which is not a stack policy. -x replays that policy exactly for the
+ * listed sizes so the two can be compared. Neither model accounts for
+ * pinned entries being unevictable.
+ */
+
+#include <cstdlib>
+#include "file_cache_trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* StackDistance
+ * Mattson stack distance of each access: the number of distinct keys
+ * referenced since the previous access to the same key. A Fenwick tree
+ * holds a 1 at the time of each key's most recent access, so the distance
+ * is a range count.
+ */
+class StackDistance {
+public:
+    static const int64_t kCold = -1;
+
+    explicit StackDistance(size_t max_accesses) : tree_(max_accesses + 1, 0),
+                                                  now_(0)
+    {}
+
+    int64_t Access(uint32_t key)
+    {
+        if (key >= last_access_.size()) {
+            last_access_.resize(key + 1, 0);
+        }
+        int64_t distance = kCold;
+        //Times are 1-based in the tree, 0 means never accessed
+        uint64_t last = last_access_[key];
+        now_++;
+        if (last != 0) {
+            distance = prefix(now_ - 1) - prefix(last);
+            update(last, -1);
+        }
+        update(now_, 1);
+        last_access_[key] = now_;
+        return distance;
+    }
+
+private:
+    vector<int32_t> tree_;
+    vector<uint64_t> last_access_;
+    uint64_t now_;
+
+    void update(uint64_t i, int32_t delta)
+    {
+        for (; i < tree_.size(); i += i & -i) {
+            tree_[i] += delta;
+        }
+    }
+    int64_t prefix(uint64_t i) const
+    {
+        int64_t sum = 0;
+        for (; i > 0; i -= i & -i) {
+            sum += tree_[i];
+        }
+        return sum;
+    }
+};
+
+static uint32_t
+hash_name(const string& name)
+{
+    //FNV-1a followed by a final avalanche so low bits are usable
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : name) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+/*load_accesses
+ * Input: trace path and whether it is a text trace
+ * Output: names and the access stream as indexes into names
+ */
+static void
+load_accesses(const string& path, bool text, vector<string>& names,
+              vector<uint32_t>& accesses)
+{
+    if (!text) {
+        FileCacheTrace trace = ReadFileCacheTrace(path);
+        names.swap(trace.names);
+        for (const auto& event : trace.events) {
+            if (event.op == kTracePin || event.op == kTracePinRead) {
+                accesses.insert(accesses.end(), event.names.begin(),
+                                event.names.end());
+            }
+        }
+        return;
+    }
+    ifstream in(path.c_str());
+    if (!in) {
+        throw runtime_error("Error opening trace file " + path);
+    }
+    map<string, uint32_t> ids;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        auto itr = ids.insert(make_pair(line, (uint32_t)names.size()));
+        if (itr.second) {
+            names.push_back(line);
+        }
+        accesses.push_back(itr.first->second);
+    }
+}
+
+/*simulate_name_order
+ * Output: miss ratio of FileCacheImpl's eviction order (smallest file name
+ *         first) for a cache of 'cache_entries' entries.
+ */
+static double
+simulate_name_order(const vector<string>& names,
+                    const vector<uint32_t>& accesses, size_t cache_entries)
+{
+    //Rank of each name in std::map order
+    vector<uint32_t> order(names.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return names[a] < names[b];
+    });
+    vector<uint32_t> rank(names.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        rank[order[i]] = i;
+    }
+    set<uint32_t> resident;
+    uint64_t misses = 0;
+    for (auto key : accesses) {
+        if (resident.count(rank[key])) {
+            continue;
+        }
+        misses++;
+        if (resident.size() == cache_entries) {
+            resident.erase(resident.begin());
+        }
+        resident.insert(rank[key]);
+    }
+    return accesses.empty() ? 0 : (double)misses / accesses.size();
+}
+
+static void
+usage(const char *prog)
+{
+    cerr << "usage: " << prog
+         << " [-r rate] [-n points] [-x size,size,...] [-t] trace" << endl;
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    double rate = 1.0;
+    int points = 64;
+    bool text = false;
+    vector<size_t> exact_sizes;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:x:t")) != -1) {
+        switch (opt) {
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            points = atoi(optarg);
+            break;
+        case 'x': {
+            istringstream sizes(optarg);
+            string size;
+            while (getline(sizes, size, ',')) {
+                int entries = atoi(size.c_str());
+                //A cache of no entries can't hold anything to evict
+                if (entries < 1) {
+                    usage(argv[0]);
+                }
+                exact_sizes.push_back(entries);
+            }
+            break;
+        }
+        case 't':
+            text = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || rate <= 0 || rate > 1 || points < 1) {
+        usage(argv[0]);
+    }
+
+    vector<string> names;
+    vector<uint32_t> accesses;
+    try {
+        load_accesses(argv[optind], text, names, accesses);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    //SHARDS fixed-rate sampling on the key hash
+    const uint32_t kModulus = 1 << 24;
+    uint32_t threshold = (uint32_t)(rate * kModulus);
+    vector<bool> sampled(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        sampled[i] = (hash_name(names[i]) % kModulus) < threshold;
+    }
+
+    auto start = chrono::steady_clock::now();
+    StackDistance stack(accesses.size());
+    vector<uint64_t> distance_hist;
+    uint64_t cold = 0;
+    uint64_t sampled_accesses = 0;
+    for (auto key : accesses) {
+        if (!sampled[key]) {
+            continue;
+        }
+        sampled_accesses++;
+        int64_t distance = stack.Access(key);
+        if (distance == StackDistance::kCold) {
+            cold++;
+            continue;
+        }
+        size_t scaled = (size_t)(distance / rate);
+        if (scaled >= distance_hist.size()) {
+            distance_hist.resize(scaled + 1, 0);
+        }
+        distance_hist[scaled]++;
+    }
+    double seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+
+    //SHARDS-adj: credit the difference between the expected and actual
+    //sample size to the smallest distance so the curve is not biased
+    double expected = accesses.size() * rate;
+    double adjust = expected - sampled_accesses;
+    double total = sampled_accesses + adjust;
+    if (distance_hist.empty()) {
+        distance_hist.push_back(0);
+    }
+
+    cerr << accesses.size() << " accesses, " << names.size() << " files, "
+         << sampled_accesses << " sampled, "
+         << (uint64_t)(accesses.size() / (seconds > 0 ? seconds : 1e-9))
+         << " accesses/s" << endl;
+
+    //Misses for size c: cold misses plus every distance >= c
+    vector<double> misses_at(distance_hist.size() + 1);
+    misses_at[distance_hist.size()] = cold;
+    for (size_t d = distance_hist.size(); d-- > 0;) {
+        misses_at[d] = misses_at[d + 1] + distance_hist[d];
+    }
+    misses_at[0] += adjust;
+
+    size_t max_size = distance_hist.size();
+    cout << "policy,cache_entries,miss_ratio" << endl;
+    size_t last = 0;
+    for (int p = 1; p <= points; p++) {
+        //Log spaced sizes from 1 to the largest distance seen
+        size_t size = (size_t)(pow((double)max_size, (double)p / points) + 0.5);
+        if (size <= last) {
+            continue;
+        }
+        last = size;
+        double ratio = total > 0 ? misses_at[min(size, max_size)] / total : 0;
+        cout << "lru," << size << "," << min(1.0, max(0.0, ratio)) << endl;
+    }
+    for (auto size : exact_sizes) {
+        cout << "name_order," << size << ","
+             << simulate_name_order(names, accesses, size) << endl;
+    }
+    return 0;
+}
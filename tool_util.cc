@@ -0,0 +1,44 @@
+#include "tool_util.h"
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+std::string
+MakeTempDir(const std::string& parent, const std::string& prefix)
+{
+    std::string dir = parent;
+    if (dir.empty()) {
+        dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    }
+    std::string templ = dir + "/" + prefix + ".XXXXXX";
+    std::vector<char> buf(templ.begin(), templ.end());
+    buf.push_back('\0');
+    if (mkdtemp(buf.data()) == nullptr) {
+        fprintf(stderr, "mkdtemp %s : %s\n", templ.c_str(), strerror(errno));
+        return "";
+    }
+    return buf.data();
+}
+
+void
+RemoveTree(const std::string& path)
+{
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        unlink(path.c_str());
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != nullptr) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        RemoveTree(path + "/" + de->d_name);
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+}
@@ -0,0 +1,17 @@
+
+#ifndef _TOOL_UTIL_H_
+#define _TOOL_UTIL_H_
+
+#include <string>
+
+// Helpers shared by the bench, workload and trace tools.
+
+// Creates a fresh directory '<parent>/<prefix>.XXXXXX'. An empty 'parent'
+// means $TMPDIR, or /tmp if that is not set. Returns "" on failure after
+// printing the reason.
+std::string MakeTempDir(const std::string& parent, const std::string& prefix);
+
+// Recursively removes 'path'.
+void RemoveTree(const std::string& path);
+
+#endif // _TOOL_UTIL_H_
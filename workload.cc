@@ -0,0 +1,398 @@
+/*
+ * File:   workload.cc
+ *
+ * Synthetic workload driver for sizing FileCacheImpl. Threads repeatedly
+ * pin a set of files, read or write each of them and unpin the set. The
+ * file picked for each slot of the pin set follows one of
+ *
+ *   uniform   every file equally likely
+ *   zipf      Zipfian popularity with skew -z
+ *   hotshift  zipf, but the popular files move every -S operations
+ *   scan      one shared cursor walking the files in order
+ *
+ * At the end a single CSV line (after a header) reports hit ratio,
+ * throughput and latency percentiles. With -I the run is repeated with a
+ * second cache that warm starts from the first one's index, and a second
+ * line reports it. Working files are created in a
+ * mkdtemp directory under -T (default $TMPDIR or /tmp) and removed.
+ */
+
+#include <cstdlib>
+#include "file_cache_impl.h"
+#include "tool_util.h"
+#include <thread>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+struct WorkloadConfig {
+    WorkloadConfig() : distribution("zipf"), num_files(1000),
+                       cache_entries(100), threads(4), ops(10000),
+                       zipf_theta(0.99), write_ratio(0.1),
+                       min_pin_set(1), max_pin_set(1),
+                       shift_interval(10000), seed(1),
+                       write_protect(false), clean_check(kCleanCheckNone),
+                       warm_restart(false), l2_mb(0), compress_ms(0),
+                       snapshot_reads(false), lazy_load(false)
+    {}
+    string distribution;
+    int num_files;
+    int cache_entries;
+    int threads;
+    int ops;                 //pin/unpin rounds per thread
+    double zipf_theta;
+    double write_ratio;      //fraction of file accesses that write
+    int min_pin_set;
+    int max_pin_set;
+    int shift_interval;      //operations between hot set moves (hotshift)
+    unsigned seed;
+    string dir;
+    string trace_path;       //record the run for file_cache_replay
+    bool write_protect;      //FileCacheOptions::write_protect
+    FileCacheCleanCheck clean_check;
+    bool warm_restart;       //rerun from FileCacheOptions::index_path
+    int l2_mb;               //L2 tier size, 0 for none
+    int compress_ms;         //FileCacheOptions::compress_after_ms, 0 off
+    bool snapshot_reads;     //FileCacheOptions::snapshot_reads
+    bool lazy_load;          //FileCacheOptions::lazy_load
+};
+
+/* ZipfGenerator
+ * Draws ranks 0..n-1 with P(rank k) proportional to 1 / (k + 1)^theta
+ * by binary searching a precomputed CDF.
+ */
+class ZipfGenerator {
+public:
+    ZipfGenerator(int n, double theta) : cdf_(n)
+    {
+        double sum = 0;
+        for (int k = 0; k < n; k++) {
+            sum += 1.0 / pow(k + 1.0, theta);
+            cdf_[k] = sum;
+        }
+        for (int k = 0; k < n; k++) {
+            cdf_[k] /= sum;
+        }
+    }
+    template <class Rng>
+    int operator()(Rng& rng)
+    {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+    }
+private:
+    vector<double> cdf_;
+};
+
+class Workload {
+public:
+    Workload(const WorkloadConfig& cfg) : failed_pins_(0),
+                                          cfg_(cfg),
+                                          zipf_(cfg.num_files, cfg.zipf_theta),
+                                          scan_cursor_(0),
+                                          ops_done_(0)
+    {
+        for (int i = 0; i < cfg.num_files; i++) {
+            ostringstream name;
+            name << cfg.dir << "/w" << i;
+            names_.push_back(name.str());
+        }
+        //Scatter popularity ranks across the file names so the hot files
+        //are not simply the first ones in name order
+        rank_to_file_.resize(cfg.num_files);
+        for (int i = 0; i < cfg.num_files; i++) {
+            rank_to_file_[i] = i;
+        }
+        mt19937 rng(cfg.seed);
+        shuffle(rank_to_file_.begin(), rank_to_file_.end(), rng);
+    }
+
+    void Run(FileCacheImpl& fc, int thread_id);
+
+    // Whole-round latency (pin, access, unpin) across all threads
+    FileCacheHistogram round_latency_;
+    // Files of a pin set that came back without a buffer
+    atomic<uint64_t> failed_pins_;
+
+private:
+    const WorkloadConfig& cfg_;
+    vector<string> names_;
+    vector<int> rank_to_file_;
+    ZipfGenerator zipf_;
+    atomic<uint64_t> scan_cursor_;
+    atomic<uint64_t> ops_done_;
+
+    int pick_file(mt19937& rng);
+};
+
+int
+Workload::pick_file(mt19937& rng)
+{
+    const string& dist = cfg_.distribution;
+    if (dist == "uniform") {
+        return rng() % cfg_.num_files;
+    } else if (dist == "scan") {
+        return scan_cursor_.fetch_add(1, memory_order_relaxed) % cfg_.num_files;
+    }
+    int rank = zipf_(rng);
+    if (dist == "hotshift") {
+        //Rotate the popularity ranks by a tenth of the files per interval
+        uint64_t shifts = ops_done_.load(memory_order_relaxed) /
+                          cfg_.shift_interval;
+        rank = (rank + shifts * (cfg_.num_files / 10 + 1)) % cfg_.num_files;
+    }
+    return rank_to_file_[rank];
+}
+
+void
+Workload::Run(FileCacheImpl& fc, int thread_id)
+{
+    mt19937 rng(cfg_.seed * 7919 + thread_id);
+    uniform_int_distribution<int> pin_set_size(cfg_.min_pin_set,
+                                               cfg_.max_pin_set);
+    uniform_real_distribution<double> coin(0.0, 1.0);
+    vector<string> file_vec;
+    vector<bool> writes;
+    for (int i = 0; i < cfg_.ops; i++) {
+        int set_size = pin_set_size(rng);
+        file_vec.clear();
+        while ((int)file_vec.size() < set_size) {
+            const string& name = names_[pick_file(rng)];
+            //A file may only appear once in a pin set
+            if (find(file_vec.begin(), file_vec.end(), name) == file_vec.end()) {
+                file_vec.push_back(name);
+            }
+        }
+        writes.clear();
+        bool any_write = false;
+        for (size_t j = 0; j < file_vec.size(); j++) {
+            writes.push_back(coin(rng) < cfg_.write_ratio);
+            any_write = any_write || writes.back();
+        }
+        auto start = chrono::steady_clock::now();
+        if (!any_write) {
+            //Read-only rounds take read pins and read without the lock
+            vector<const char *> bufs = fc.PinFilesForRead(file_vec);
+            for (auto buf : bufs) {
+                if (buf == nullptr) {
+                    failed_pins_.fetch_add(1, memory_order_relaxed);
+                    continue;
+                }
+                volatile char c = buf[i % FILE_SIZE];
+                (void)c;
+            }
+            fc.UnpinFilesForRead(file_vec);
+        } else {
+            fc.PinFiles(file_vec);
+            for (size_t j = 0; j < file_vec.size(); j++) {
+                if (writes[j]) {
+                    char *buf = fc.MutableFileData(file_vec[j]);
+                    if (buf == nullptr) {
+                        failed_pins_.fetch_add(1, memory_order_relaxed);
+                        continue;
+                    }
+                    buf[i % FILE_SIZE] = (char)i;
+                } else {
+                    const char *buf = fc.FileData(file_vec[j]);
+                    if (buf == nullptr) {
+                        failed_pins_.fetch_add(1, memory_order_relaxed);
+                        continue;
+                    }
+                    volatile char c = buf[i % FILE_SIZE];
+                    (void)c;
+                }
+            }
+            fc.UnpinFiles(file_vec);
+        }
+        round_latency_.Record(chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start).count());
+        ops_done_.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+/*run_workload
+ * Runs all threads against a fresh cache and prints the CSV line. With an
+ * index path the cache warm starts from it and saves it at the end.
+ */
+static void
+run_workload(const WorkloadConfig& cfg, Workload& workload,
+             const string& index_path, const char *start_label)
+{
+    double seconds;
+    FileCacheStats stats;
+    FileCacheLatency latency;
+    workload.round_latency_.Snapshot(true);
+    workload.failed_pins_.store(0, memory_order_relaxed);
+    {
+        FileCacheOptions options;
+        //Only the first run is traced
+        if (strcmp(start_label, "cold") == 0) {
+            options.trace_path = cfg.trace_path;
+        }
+        options.write_protect = cfg.write_protect;
+        options.clean_check = cfg.clean_check;
+        options.snapshot_reads = cfg.snapshot_reads;
+        options.lazy_load = cfg.lazy_load;
+        options.index_path = index_path;
+        if (cfg.compress_ms > 0) {
+            options.compress = true;
+            options.compress_after_ms = cfg.compress_ms;
+        }
+        if (cfg.l2_mb > 0) {
+            options.l2_path = cfg.dir + "/l2";
+            options.l2_bytes = (uint64_t)cfg.l2_mb << 20;
+        }
+        FileCacheImpl fc(cfg.cache_entries, options);
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < cfg.threads; t++) {
+            workers.push_back(thread(&Workload::Run, &workload,
+                                     ref(fc), t));
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        seconds = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+        stats = fc.GetStats();
+        latency = fc.GetLatency();
+    }
+    FileCacheHistogramSnapshot rounds = workload.round_latency_.Snapshot(false);
+    uint64_t lookups = stats.hits + stats.misses;
+    uint64_t ops = (uint64_t)cfg.ops * cfg.threads;
+
+    cout << cfg.distribution << "," << cfg.num_files << ","
+         << cfg.cache_entries << "," << cfg.threads << "," << ops << ","
+         << cfg.write_ratio << ","
+         << (lookups ? (double)stats.hits / lookups : 0) << ","
+         << ops / seconds << ","
+         << rounds.Percentile(0.50) << "," << rounds.Percentile(0.99) << ","
+         << rounds.Percentile(0.999) << ","
+         << latency.pin.Percentile(0.50) << ","
+         << latency.pin.Percentile(0.99) << ","
+         << latency.pin.Percentile(0.999) << ","
+         << stats.dirty_evictions << "," << stats.clean_evictions << ","
+         << stats.skipped_write_backs << "," << stats.wait_ns << ","
+         << stats.l2_hits << "," << stats.compressed_hits << ","
+         << (stats.compress_out_bytes ?
+             (double)stats.compress_in_bytes / stats.compress_out_bytes : 0)
+         << "," << latency.decompress.Percentile(0.50) << ","
+         << latency.decompress.Percentile(0.99) << ","
+         << workload.failed_pins_.load(memory_order_relaxed) << ","
+         << start_label << endl;
+}
+
+static void
+usage(const char *prog)
+{
+    cerr << "usage: " << prog << " [options]\n"
+         << "  -D dist     uniform|zipf|hotshift|scan (zipf)\n"
+         << "  -f files    number of distinct files (1000)\n"
+         << "  -c entries  cache size in entries (100)\n"
+         << "  -t threads  worker threads (4)\n"
+         << "  -n ops      pin/unpin rounds per thread (10000)\n"
+         << "  -z theta    zipf skew (0.99)\n"
+         << "  -w ratio    fraction of accesses that write (0.1)\n"
+         << "  -p min,max  files per PinFiles call (1,1)\n"
+         << "  -S ops      hot set shift interval for hotshift (10000)\n"
+         << "  -s seed     random seed (1)\n"
+         << "  -T dir      parent of the working directory ($TMPDIR or /tmp)\n"
+         << "  -o trace    record the run into a trace file\n"
+         << "  -W          detect writes with page protection\n"
+         << "  -C check    none|shadow|hash, skip unchanged write-backs (none)\n"
+         << "  -I          run again, warm started from the first run's index\n"
+         << "  -L mb       add an L2 tier of this size in the working directory\n"
+         << "  -Z ms       compress entries not pinned for this long\n"
+         << "  -V          versioned buffers, read pins see snapshots\n"
+         << "  -Y          load pages on first touch through userfaultfd\n";
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    WorkloadConfig cfg;
+    string parent;
+    int opt;
+    while ((opt = getopt(argc, argv, "D:f:c:t:n:z:w:p:S:s:T:o:WC:IL:Z:VY")) != -1) {
+        switch (opt) {
+        case 'D': cfg.distribution = optarg; break;
+        case 'f': cfg.num_files = atoi(optarg); break;
+        case 'c': cfg.cache_entries = atoi(optarg); break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'n': cfg.ops = atoi(optarg); break;
+        case 'z': cfg.zipf_theta = atof(optarg); break;
+        case 'w': cfg.write_ratio = atof(optarg); break;
+        case 'p':
+            if (sscanf(optarg, "%d,%d", &cfg.min_pin_set,
+                       &cfg.max_pin_set) != 2) {
+                cfg.max_pin_set = cfg.min_pin_set;
+            }
+            break;
+        case 'S': cfg.shift_interval = atoi(optarg); break;
+        case 's': cfg.seed = atoi(optarg); break;
+        case 'T': parent = optarg; break;
+        case 'o': cfg.trace_path = optarg; break;
+        case 'W': cfg.write_protect = true; break;
+        case 'I': cfg.warm_restart = true; break;
+        case 'L': cfg.l2_mb = atoi(optarg); break;
+        case 'Z': cfg.compress_ms = atoi(optarg); break;
+        case 'V': cfg.snapshot_reads = true; break;
+        case 'Y': cfg.lazy_load = true; break;
+        case 'C':
+            if (strcmp(optarg, "none") == 0) {
+                cfg.clean_check = kCleanCheckNone;
+            } else if (strcmp(optarg, "shadow") == 0) {
+                cfg.clean_check = kCleanCheckShadow;
+            } else if (strcmp(optarg, "hash") == 0) {
+                cfg.clean_check = kCleanCheckHash;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (cfg.distribution != "uniform" && cfg.distribution != "zipf" &&
+        cfg.distribution != "hotshift" && cfg.distribution != "scan") {
+        usage(argv[0]);
+    }
+    if (cfg.num_files < 1 || cfg.threads < 1 || cfg.ops < 1 ||
+        cfg.shift_interval < 1 || cfg.min_pin_set < 1 ||
+        cfg.max_pin_set < cfg.min_pin_set || cfg.max_pin_set > cfg.num_files) {
+        usage(argv[0]);
+    }
+    //Every thread may hold a full pin set at once, see FileCache::PinFiles()
+    if (cfg.threads * cfg.max_pin_set > cfg.cache_entries) {
+        cerr << "threads * max pin set (" << cfg.threads * cfg.max_pin_set
+             << ") exceeds the cache size " << cfg.cache_entries
+             << " and could deadlock" << endl;
+        return 2;
+    }
+
+    cfg.dir = MakeTempDir(parent, "file_cache_workload");
+    if (cfg.dir.empty()) {
+        return 1;
+    }
+
+    Workload workload(cfg);
+    cout << "distribution,files,cache_entries,threads,ops,write_ratio,"
+         << "hit_ratio,ops_per_sec,round_p50_ns,round_p99_ns,round_p999_ns,"
+         << "pin_p50_ns,pin_p99_ns,pin_p999_ns,dirty_evictions,"
+         << "clean_evictions,skipped_write_backs,wait_ns,l2_hits,"
+         << "compressed_hits,compression_ratio,decompress_p50_ns,"
+         << "decompress_p99_ns,failed_pins,start" << endl;
+    string index_path = cfg.warm_restart ? cfg.dir + "/index" : "";
+    run_workload(cfg, workload, index_path, "cold");
+    if (cfg.warm_restart) {
+        run_workload(cfg, workload, index_path, "warm");
+    }
+
+    RemoveTree(cfg.dir);
+    return 0;
+}